@@ -45,6 +45,73 @@ constexpr unsigned SPREADSHEET_SPEED = 0x08;
 constexpr unsigned SPREADSHEET_PARSER = 0x10;
 #endif /* __PROGTEST__ */
 
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <shared_mutex>
+
+// a platform without mmap, such as Windows, reads the whole file of loadMapped into memory instead
+#ifndef SPREADSHEET_MMAP
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#define SPREADSHEET_MMAP 1
+#else
+#define SPREADSHEET_MMAP 0
+#endif
+#endif
+
+#if SPREADSHEET_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** Function for appending a number in its shortest form that reads back to the same value
+ * @param[out] out - string the number is appended to
+ * @param[in] val - number to be appended
+*/
+template<typename T>
+void appendNumber(std::string &out, T val) {
+    char buffer[32];
+    std::to_chars_result result = std::to_chars(std::begin(buffer), std::end(buffer), val);
+    out.append(buffer, result.ptr);
+}
+
+/** Function for reading the contents of a cell as a number. The contents is a number if, apart from the whitespace
+ * around, it is an optional sign followed by a decimal literal like 12, 1.5, .5 or 3e-2 read by std::from_chars as a
+ * whole. Anything else, including a literal out of the range of double, infinity, nan or a hexadecimal literal, is a
+ * text.
+ * @param[in] str - contents of the cell
+ * @param[out] val - number read from the contents
+ * @return true if the contents is a number, false otherwise
+*/
+inline bool parseNumber(std::string_view str, double &val) {
+    auto space = [](char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; };
+    while (!str.empty() && space(str.front())) {
+        str.remove_prefix(1);
+    }
+    while (!str.empty() && space(str.back())) {
+        str.remove_suffix(1);
+    }
+
+    bool negative = !str.empty() && str.front() == '-';
+    if (!str.empty() && (str.front() == '+' || negative)) {
+        str.remove_prefix(1);
+    }
+    // from_chars would read infinity and nan as well and a second sign
+    if (str.empty() || !(std::isdigit(static_cast<unsigned char>(str.front())) || str.front() == '.')) {
+        return false;
+    }
+
+    std::from_chars_result result = std::from_chars(str.data(), str.data() + str.size(), val);
+    if (result.ec != std::errc() || result.ptr != str.data() + str.size()) {
+        return false;
+    }
+
+    val = negative ? -val : val;
+    return true;
+}
 
 /** Class representing a position in the spreadsheet */
 class CPos {
@@ -57,7 +124,17 @@ public:
         }
     };
 
-    CPos(size_t col, size_t row) : m_col(col), m_row(row) {};
+    CPos(size_t col, size_t row) : m_col(col), m_row(row) {
+        if (col > MAX_INDEX || row > MAX_INDEX) {
+            throw std::invalid_argument("Invalid position");
+        }
+    };
+
+    /** Static method for creating a position from a packed key
+     * @param[in] key - key created by getKey
+     * @return position with relative column and row
+    */
+    static CPos fromKey(uint64_t key);
 
     /** Method for updating the position
      * @param[in] offset - offset to be added to the position
@@ -65,9 +142,9 @@ public:
     void updatePos(const std::pair<int, int> &offset);
 
     /** Method for converting the position represented by size_t to a string
-     * @param[out] os - output stream
+     * @param[out] out - string the position is appended to
     */
-    void toStr(std::ostream &os) const;
+    void toStr(std::string &out) const;
 
     /** Method for comparing two positions
      * @param[in] other - position to be compared with
@@ -91,6 +168,16 @@ public:
     */
     size_t getRow() const;
 
+    /** Method for packing the column and the row into a single key, keys are ordered the same way as positions
+     * @return column in the upper and row in the lower 32 bits, INVALID_KEY for a position shifted off the sheet
+    */
+    uint64_t getKey() const;
+
+    /** Maximal column and row, UINT32_MAX is left out so that INVALID_KEY never matches a cell */
+    static constexpr size_t MAX_INDEX = UINT32_MAX - 1;
+    /** Key of the positions outside of the sheet, no cell has it as its column and row exceed MAX_INDEX */
+    static constexpr uint64_t INVALID_KEY = UINT64_MAX;
+
 private:
 
     size_t m_col;
@@ -127,7 +214,7 @@ private:
 
 };
 
-void CPos::updatePos(const std::pair<int, int> &offset) {
+inline void CPos::updatePos(const std::pair<int, int> &offset) {
     if (!m_absCol) {
         m_col += offset.first;
     }
@@ -137,43 +224,55 @@ void CPos::updatePos(const std::pair<int, int> &offset) {
     }
 }
 
-void CPos::toStr(std::ostream &os) const {
+inline void CPos::toStr(std::string &out) const {
     if (m_absCol) {
-        os << "$";
+        out += '$';
     }
 
-    std::string str;
+    size_t start = out.size();
     size_t num = m_col;
     while (num > 0) {
-        char ch = 'A' + (num - 1) % 26;
-        str = ch + str;
+        out += char('A' + (num - 1) % 26);
         num = (num - 1) / 26;
     }
-    os << str;
+    std::reverse(out.begin() + std::ptrdiff_t(start), out.end());
 
     if (m_absRow) {
-        os << "$";
+        out += '$';
     }
-    os << std::to_string(m_row);
+    appendNumber(out, m_row);
 }
 
-bool CPos::operator<(const CPos &other) const {
+inline bool CPos::operator<(const CPos &other) const {
     return std::tie(m_col, m_row) < std::tie(other.m_col, other.m_row);
 }
 
-bool CPos::operator==(const CPos &other) const {
+inline bool CPos::operator==(const CPos &other) const {
     return std::tie(m_col, m_row) == std::tie(other.m_col, other.m_row);
 }
 
-size_t CPos::getCol() const {
+inline size_t CPos::getCol() const {
     return m_col;
 }
 
-size_t CPos::getRow() const {
+inline size_t CPos::getRow() const {
     return m_row;
 }
 
-bool CPos::setRowCol(const std::string_view &str) {
+inline CPos CPos::fromKey(uint64_t key) {
+    return {size_t(key >> 32), size_t(key & UINT32_MAX)};
+}
+
+inline uint64_t CPos::getKey() const {
+    // a relative position shifted before the first column or row wraps around to a large index
+    if (m_col > MAX_INDEX || m_row > MAX_INDEX) {
+        return INVALID_KEY;
+    }
+
+    return (uint64_t(m_col) << 32) | m_row;
+}
+
+inline bool CPos::setRowCol(const std::string_view &str) {
     if (str.size() < 2) {
         return false;
     }
@@ -186,17 +285,17 @@ bool CPos::setRowCol(const std::string_view &str) {
     return true;
 }
 
-size_t CPos::toNum(const std::string_view &str, size_t &i) {
+inline size_t CPos::toNum(const std::string_view &str, size_t &i) {
     size_t num = 0;
     while (i < str.size() && std::isalpha(str[i])) {
-        num = num * 26 + (std::toupper(str[i]) - 'A' + 1);
+        num = std::min(num * 26 + (std::toupper(str[i]) - 'A' + 1), MAX_INDEX + 1);
         i++;
     }
 
     return num;
 }
 
-bool CPos::processCol(const std::string_view &str, size_t &i) {
+inline bool CPos::processCol(const std::string_view &str, size_t &i) {
     if (str[i] == '$') {
         m_absCol = true;
         i++;
@@ -208,10 +307,10 @@ bool CPos::processCol(const std::string_view &str, size_t &i) {
 
     m_col = toNum(str, i);
 
-    return true;
+    return m_col <= MAX_INDEX;
 }
 
-bool CPos::processRow(const std::string_view &str, size_t &i) {
+inline bool CPos::processRow(const std::string_view &str, size_t &i) {
     if (str[i] == '$') {
         m_absRow = true;
         i++;
@@ -226,534 +325,874 @@ bool CPos::processRow(const std::string_view &str, size_t &i) {
 
     try {
         m_row = std::stoull(numbers);
-    } catch (const std::invalid_argument &e) {
+    } catch (const std::logic_error &e) {
         return false;
     }
 
-    return true;
+    return m_row <= MAX_INDEX;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
-/** Base class representing an expression node */
-class CNode {
+/** Enum representing the instructions of a compiled formula */
+enum class EOp : uint8_t {
+    Number, String, Ref, Range, Add, Sub, Mul, Div, Pow, Neg, Eq, Ne, Lt, Le, Gt, Ge,
+    Sum, Count, Min, Max, Avg, CountVal, If
+};
 
-public:
+/** Struct representing a single instruction of a compiled formula */
+struct CInstr {
+    EOp m_op;
+    /** Index into the constants, references or ranges of the program, unused by operators */
+    uint32_t m_arg;
+};
 
-    virtual ~CNode() = default;
+/** Struct representing a rectangle of cells given by the keys of its top-left and bottom-right corners */
+struct CRange {
+    uint64_t m_from;
+    uint64_t m_to;
 
-    /** Method for evaluating the node
-     * @param[in] visited - set of visited nodes
-     * @return value of the node
+    /** Method for checking if a position lies in the range
+     * @param[in] key - key of the position
+     * @return true if the position lies in the range, false otherwise
     */
-    virtual CValue evaluate(std::set<CPos> &visited) const = 0;
+    bool contains(uint64_t key) const {
+        return (key >> 32) >= (m_from >> 32) && (key >> 32) <= (m_to >> 32)
+               && (key & UINT32_MAX) >= (m_from & UINT32_MAX) && (key & UINT32_MAX) <= (m_to & UINT32_MAX);
+    }
 
-    /** Method for cloning the node
-     * @param[in] map - map of the nodes
-     * @return shared pointer to the cloned node
+    /** Method for getting the number of the positions in the range
+     * @return width times height of the range, UINT64_MAX if it does not fit
     */
-    virtual std::shared_ptr<CNode> clone(const std::map<CPos, std::shared_ptr<CNode>> &map) const = 0;
+    uint64_t area() const {
+        uint64_t w = (m_to >> 32) - (m_from >> 32) + 1, h = (m_to & UINT32_MAX) - (m_from & UINT32_MAX) + 1;
 
-    /** Method for updating the reference
-     * @param[in] offset - offset to be added to the position
-    */
-    virtual void updateRef(std::pair<int, int> offset) = 0;
+        return w > UINT64_MAX / h ? UINT64_MAX : w * h;
+    }
+};
 
-    /** Method for saving the node
-     * @param[out] os - output stream
-    */
-    virtual void save(std::ostream &os) const = 0;
+/** Struct representing a value on the stack of a running program, a string is borrowed from the program or from a
+ * clean cell as long as it is only read and copied into the own buffer of the slot once an operator builds a new one */
+struct CSlot {
+    /** Kinds of the value */
+    enum EKind : uint8_t {
+        Empty, Number, View, Owned
+    };
 
-    /** Method for checking if the node is an expression
-     * @return true if the node is an expression, false otherwise
+    EKind m_kind = Empty;
+    double m_number = 0;
+    const std::string *m_view = nullptr;
+    std::string m_owned;
+
+    /** Method for storing a number
+     * @param[in] val - number to be stored
     */
-    bool isExpr() const;
+    void set(double val) {
+        m_kind = Number;
+        m_number = val;
+    }
 
-    /** Method for setting the node as an expression */
-    void setExpr();
+    /** Method for storing a string without copying it
+     * @param[in] val - string to be stored, it has to outlive the slot
+    */
+    void borrow(const std::string &val) {
+        m_kind = View;
+        m_view = &val;
+    }
 
+    /** Method for storing a value without copying its string
+     * @param[in] val - value to be stored, it has to outlive the slot
+    */
+    void borrow(const CValue &val);
 
-protected:
-    bool m_expr = false;
-};
+    /** Method for getting the string
+     * @return the borrowed or the owned string
+    */
+    const std::string &str() const {
+        return m_kind == View ? *m_view : m_owned;
+    }
 
-bool CNode::isExpr() const {
-    return m_expr;
-}
+    /** Method for turning the value into an own string, a number is written like std::to_string does
+     * @return the own string of the slot
+    */
+    std::string &own();
 
-void CNode::setExpr() {
-    m_expr = true;
-}
+    /** Method for comparing the value to a value of a cell
+     * @param[in] val - value of the cell
+     * @return true if both are equal numbers or equal strings, false otherwise
+    */
+    bool equals(const CValue &val) const;
 
-using ANode = std::shared_ptr<CNode>;
+    /** Method for taking the value out of the slot
+     * @return the value, an owned string is moved out
+    */
+    CValue take();
 
-/** Derived class from Node representing a CValue node*/
-class CValueNode : public CNode {
+    /** Static method for appending a number the way std::to_string writes it, without a temporary string
+     * @param[out] out - string the text is appended to
+     * @param[in] val - number to be written
+    */
+    static void appendFixed(std::string &out, double val);
+};
 
-public:
-    CValueNode(const CValue &val) : m_val(val) {};
+/** Struct representing the value stack of the running programs, the slots above the top are not destroyed, so the
+ * buffers of their strings are reused by the next runs */
+struct CSlotStack {
+    std::vector<CSlot> m_slots;
+    size_t m_size = 0;
 
-    CValueNode(const CValue &val, const std::string &str) : m_val(val), m_valToSave(str), m_exprStr(true) {}
+    /** Method for pushing a slot
+     * @return reference to the pushed slot, valid until the next push
+    */
+    CSlot &push() {
+        if (m_size == m_slots.size()) {
+            m_slots.emplace_back();
+        }
 
-    CValue evaluate(std::set<CPos> &visited) const override {
-        return m_val;
+        return m_slots[m_size++];
     }
+};
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<CValueNode> tmp = std::make_shared<CValueNode>(m_val);
-        tmp->m_exprStr = m_exprStr;
-        tmp->m_valToSave = m_valToSave;
-        tmp->m_expr = m_expr;
+inline void CSlot::borrow(const CValue &val) {
+    switch (val.index()) {
+        case 1:
+            set(std::get<double>(val));
+            return;
+        case 2:
+            borrow(std::get<std::string>(val));
+            return;
+        default:
+            m_kind = Empty;
+    }
+}
 
-        return tmp;
+inline std::string &CSlot::own() {
+    if (m_kind == View) {
+        m_owned.assign(*m_view);
+    } else if (m_kind == Number) {
+        m_owned.clear();
+        appendFixed(m_owned, m_number);
     }
+    m_kind = Owned;
 
-    void updateRef(std::pair<int, int> offset) override {}
+    return m_owned;
+}
 
-    void save(std::ostream &os) const override {
-        if (m_val.index() == 1) {
-            os << std::to_string(std::get<double>(m_val));
-        } else {
-            if (m_expr) {
-                os << m_valToSave;
-            } else {
-                os << std::get<std::string>(m_val);
-            }
-        }
+inline bool CSlot::equals(const CValue &val) const {
+    if (m_kind == Number) {
+        return val.index() == 1 && std::get<double>(val) == m_number;
     }
 
-private:
-    CValue m_val;
-    std::string m_valToSave;
-    bool m_exprStr = false;
+    return (m_kind == View || m_kind == Owned) && val.index() == 2
+           && (&std::get<std::string>(val) == &str() || std::get<std::string>(val) == str());
+}
 
-};
+inline void CSlot::appendFixed(std::string &out, double val) {
+    // "%f" writes the whole integer part, up to 309 digits
+    char buffer[400];
+    std::to_chars_result result = std::to_chars(std::begin(buffer), std::end(buffer), val, std::chars_format::fixed, 6);
+    out.append(buffer, result.ptr);
+}
 
-/** Derived class from Node representing a reference node */
-class CRefNode : public CNode {
+inline CValue CSlot::take() {
+    switch (m_kind) {
+        case Number:
+            return m_number;
+        case View:
+            return *m_view;
+        case Owned:
+            return std::move(m_owned);
+        default:
+            return {};
+    }
+}
+
+/** Class representing a formula compiled into a flat bytecode program evaluated on a value stack, the positions are
+ * kept as written and shifted by the offset of the evaluated cell, so that copies of a formula share one program */
+class CProgram {
 
 public:
-    CRefNode(const CPos &pos, const std::map<CPos, ANode> &map) : m_pos(pos), m_map(map) {}
 
-    CValue evaluate(std::set<CPos> &visited) const override {
-        if (m_map.find(m_pos) == m_map.end() || visited.count(m_pos) > 0) {
-            return {};
-        }
+    /** Method for appending an operator
+     * @param[in] op - operator to be appended
+     * @param[in] arg - index of the range the operator aggregates, unused by the other operators
+    */
+    void emit(EOp op, uint32_t arg = 0);
 
-        visited.emplace(m_pos);
-        CValue result = m_map.at(m_pos)->evaluate(visited);
-        visited.erase(m_pos);
+    /** Method for appending a number constant
+     * @param[in] val - number to be pushed
+    */
+    void emitNumber(double val);
 
-        return result;
-    }
+    /** Method for appending a string constant
+     * @param[in] val - string to be pushed
+    */
+    void emitString(const std::string &val);
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<CRefNode> tmp = std::make_shared<CRefNode>(m_pos, map);
-        tmp->m_expr = m_expr;
+    /** Method for appending a reference to another cell
+     * @param[in] pos - position of the referenced cell
+    */
+    void emitRef(const CPos &pos);
 
-        return tmp;
-    }
+    /** Method for adding a range of cells
+     * @param[in] from - position of one corner of the range
+     * @param[in] to - position of the opposite corner of the range
+     * @return index of the range
+    */
+    uint32_t addRange(const CPos &from, const CPos &to);
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_pos.updatePos(offset);
-    }
+    /** Method for getting the referenced positions
+     * @param[in] offset - offset to be added to the relative positions
+     * @return keys of the positions in the order of the instructions, including duplicates
+    */
+    std::vector<uint64_t> getRefs(const std::pair<int, int> &offset) const;
 
-    void save(std::ostream &os) const override {
-        m_pos.toStr(os);
-    }
+    /** Method for getting the referenced ranges
+     * @param[in] offset - offset to be added to the relative positions
+     * @return ranges in the order they were added
+    */
+    std::vector<CRange> getRanges(const std::pair<int, int> &offset) const;
+
+    /** Method for running the program
+     * @param[in] offset - offset to be added to the relative positions
+     * @param[in] load - function returning a reference to the value of a referenced cell given the key of its
+     * position, the value has to stay unchanged during the run
+     * @param[in] range - function calling its last argument with the value of every existing cell of a range
+     * @param[in,out] stack - value stack, it may be shared by nested runs and is left as it was
+     * @param[in,out] numbers - buffer the numbers of the aggregated ranges are gathered into, it may be shared by
+     * nested runs and is left as it was
+     * @return value of the formula
+    */
+    template<typename TLoad, typename TRange>
+    CValue run(const std::pair<int, int> &offset, const TLoad &load, const TRange &range, CSlotStack &stack,
+               std::vector<double> &numbers) const;
 
 private:
-    CPos m_pos;
-    const std::map<CPos, ANode> &m_map;
-
-};
+    std::vector<CInstr> m_code;
+    std::vector<double> m_numbers;
+    std::vector<std::string> m_strings;
+    std::vector<CPos> m_refs;
+    std::vector<std::pair<CPos, CPos>> m_ranges;
+
+    /** Static method for shifting a position
+     * @param[in] pos - position as written in the formula
+     * @param[in] offset - offset to be added to the relative coordinates
+     * @return key of the shifted position
+    */
+    static uint64_t resolve(CPos pos, const std::pair<int, int> &offset);
 
-/** Derived class from Node representing an addition node */
-class opAddNode : public CNode {
+    /** Method for shifting a range
+     * @param[in] index - index of the range
+     * @param[in] offset - offset to be added to the relative coordinates
+     * @return range with the top-left and bottom-right corners
+    */
+    CRange resolveRange(uint32_t index, const std::pair<int, int> &offset) const;
 
-public:
-    opAddNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
-
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
-
-        if (val1.index() == 1 && val2.index() == 1) {
-            return std::get<double>(val1) + std::get<double>(val2);
-        } else if (val1.index() == 2 && val2.index() == 2) {
-            return std::get<std::string>(val1) + std::get<std::string>(val2);
-        } else if (val1.index() == 1 && val2.index() == 2) {
-            return std::to_string(std::get<double>(val1)) + std::get<std::string>(val2);
-        } else if (val1.index() == 2 && val2.index() == 1) {
-            return std::get<std::string>(val1) + std::to_string(std::get<double>(val2));
-        } else {
-            return {};
-        }
-    }
+    /** Static method for aggregating gathered numbers
+     * @param[in] op - aggregate function, Sum, Min, Max or Avg
+     * @param[in] vals - pointer to the numbers
+     * @param[in] n - number of the numbers
+     * @param[out] result - result of the aggregate function, empty if there are no numbers
+    */
+    static void aggregate(EOp op, const double *vals, size_t n, CSlot &result);
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opAddNode> tmp = std::make_shared<opAddNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
+    /** Static method for applying a binary operator
+     * @param[in] op - operator to be applied
+     * @param[in,out] left - left operand, replaced by the result
+     * @param[in] right - right operand
+    */
+    static void apply(EOp op, CSlot &left, const CSlot &right);
+};
 
-        return tmp;
-    }
+inline void CProgram::emit(EOp op, uint32_t arg) {
+    m_code.push_back({op, arg});
+}
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
-    }
+inline void CProgram::emitNumber(double val) {
+    m_code.push_back({EOp::Number, uint32_t(m_numbers.size())});
+    m_numbers.push_back(val);
+}
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "+";
-        m_right->save(os);
-        os << ")";
-    }
+inline void CProgram::emitString(const std::string &val) {
+    m_code.push_back({EOp::String, uint32_t(m_strings.size())});
+    m_strings.push_back(val);
+}
 
-private:
-    ANode m_left;
-    ANode m_right;
+inline void CProgram::emitRef(const CPos &pos) {
+    m_code.push_back({EOp::Ref, uint32_t(m_refs.size())});
+    m_refs.push_back(pos);
+}
 
-};
+inline uint32_t CProgram::addRange(const CPos &from, const CPos &to) {
+    m_ranges.emplace_back(from, to);
 
-/** Derived class from Node representing a subtraction node */
-class opSubNode : public CNode {
+    return uint32_t(m_ranges.size() - 1);
+}
 
-public:
-    opSubNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
+inline std::vector<uint64_t> CProgram::getRefs(const std::pair<int, int> &offset) const {
+    std::vector<uint64_t> refs;
+    refs.reserve(m_refs.size());
+    for (const CPos &pos: m_refs) {
+        refs.push_back(resolve(pos, offset));
+    }
 
-    CValue evaluate(std::set<CPos> &visited) const override {
+    return refs;
+}
 
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
-        if (val1.index() == 1 && val2.index() == 1) {
-            return std::get<double>(val1) - std::get<double>(val2);
-        } else {
-            return {};
-        }
+inline std::vector<CRange> CProgram::getRanges(const std::pair<int, int> &offset) const {
+    std::vector<CRange> ranges;
+    for (uint32_t i = 0; i < m_ranges.size(); i++) {
+        ranges.push_back(resolveRange(i, offset));
     }
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opSubNode> tmp = std::make_shared<opSubNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
+    return ranges;
+}
 
-        return tmp;
-    }
+inline uint64_t CProgram::resolve(CPos pos, const std::pair<int, int> &offset) {
+    pos.updatePos(offset);
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
-    }
+    return pos.getKey();
+}
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "-";
-        m_right->save(os);
-        os << ")";
+inline CRange CProgram::resolveRange(uint32_t index, const std::pair<int, int> &offset) const {
+    uint64_t from = resolve(m_ranges[index].first, offset), to = resolve(m_ranges[index].second, offset);
+    if (from == CPos::INVALID_KEY || to == CPos::INVALID_KEY) {
+        // a range reaching off the sheet has no cells
+        return {CPos::INVALID_KEY, CPos::INVALID_KEY};
     }
 
-private:
-    ANode m_left;
-    ANode m_right;
+    return {std::min(from >> 32, to >> 32) << 32 | std::min(from & UINT32_MAX, to & UINT32_MAX),
+            std::max(from >> 32, to >> 32) << 32 | std::max(from & UINT32_MAX, to & UINT32_MAX)};
+}
 
-};
+template<typename TLoad, typename TRange>
+CValue CProgram::run(const std::pair<int, int> &offset, const TLoad &load, const TRange &range,
+                     CSlotStack &stack, std::vector<double> &numbers) const {
+    size_t base = stack.m_size;
+
+    for (const CInstr &instr: m_code) {
+        switch (instr.m_op) {
+            case EOp::Number:
+                stack.push().set(m_numbers[instr.m_arg]);
+                break;
+            case EOp::String:
+                stack.push().borrow(m_strings[instr.m_arg]);
+                break;
+            case EOp::Ref: {
+                // the loaded cell may run its own program on the same stack, the slot is pushed after it
+                const CValue &val = load(resolve(m_refs[instr.m_arg], offset));
+                stack.push().borrow(val);
+                break;
+            }
+            case EOp::Range:
+                // a range outside of a function has no value
+                stack.push().m_kind = CSlot::Empty;
+                break;
+            case EOp::Sum:
+            case EOp::Min:
+            case EOp::Max:
+            case EOp::Avg: {
+                // the numbers are gathered first, nested runs append behind them and shrink the buffer back
+                size_t first = numbers.size();
+                range(resolveRange(instr.m_arg, offset), [&numbers](const CValue &val) {
+                    if (val.index() == 1) {
+                        numbers.push_back(std::get<double>(val));
+                    }
+                });
+                aggregate(instr.m_op, numbers.data() + first, numbers.size() - first, stack.push());
+                numbers.resize(first);
+                break;
+            }
+            case EOp::Count: {
+                size_t count = 0;
+                range(resolveRange(instr.m_arg, offset), [&count](const CValue &val) { count += val.index() != 0; });
+                stack.push().set(double(count));
+                break;
+            }
+            case EOp::CountVal: {
+                // the value stays on the stack and is reached by its index, the cells of the range may run their
+                // programs above it
+                size_t at = stack.m_size - 1;
+                size_t count = 0;
+                range(resolveRange(instr.m_arg, offset), [&count, &stack, at](const CValue &other) {
+                    count += stack.m_slots[at].equals(other);
+                });
+                stack.m_slots[at].set(double(count));
+                break;
+            }
+            case EOp::If: {
+                stack.m_size -= 2;
+                CSlot &cond = stack.m_slots[stack.m_size - 1];
+                if (cond.m_kind == CSlot::Number) {
+                    // swapped rather than moved, so that no buffer of a string is lost
+                    std::swap(cond, stack.m_slots[cond.m_number != 0 ? stack.m_size : stack.m_size + 1]);
+                } else {
+                    cond.m_kind = CSlot::Empty;
+                }
+                break;
+            }
+            case EOp::Neg: {
+                CSlot &val = stack.m_slots[stack.m_size - 1];
+                if (val.m_kind == CSlot::Number) {
+                    val.m_number = -val.m_number;
+                } else {
+                    val.m_kind = CSlot::Empty;
+                }
+                break;
+            }
+            default:
+                stack.m_size--;
+                apply(instr.m_op, stack.m_slots[stack.m_size - 1], stack.m_slots[stack.m_size]);
+        }
+    }
 
-/** Derived class from Node representing a multiplication node */
-class opMulNode : public CNode {
+    CValue result = stack.m_slots[stack.m_size - 1].take();
+    stack.m_size = base;
 
-public:
-    opMulNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
+    return result;
+}
 
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
+inline void CProgram::aggregate(EOp op, const double *vals, size_t n, CSlot &result) {
+    if (n == 0) {
+        result.m_kind = CSlot::Empty;
+        return;
+    }
 
-        if (val1.index() == 1 && val2.index() == 1) {
-            return std::get<double>(val1) * std::get<double>(val2);
-        } else {
-            return {};
-        }
+    // four independent lanes break the dependency chain of the accumulator, so the loop can be vectorized
+    double acc[4] = {vals[0], vals[0], vals[0], vals[0]};
+    if (op == EOp::Sum || op == EOp::Avg) {
+        acc[0] = acc[1] = acc[2] = acc[3] = 0;
     }
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opMulNode> tmp = std::make_shared<opMulNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
-        return tmp;
+    size_t i = 0;
+    switch (op) {
+        case EOp::Min:
+            for (; i + 4 <= n; i += 4) {
+                for (size_t lane = 0; lane < 4; lane++) {
+                    acc[lane] = std::min(acc[lane], vals[i + lane]);
+                }
+            }
+            for (; i < n; i++) {
+                acc[0] = std::min(acc[0], vals[i]);
+            }
+            result.set(std::min(std::min(acc[0], acc[1]), std::min(acc[2], acc[3])));
+            return;
+        case EOp::Max:
+            for (; i + 4 <= n; i += 4) {
+                for (size_t lane = 0; lane < 4; lane++) {
+                    acc[lane] = std::max(acc[lane], vals[i + lane]);
+                }
+            }
+            for (; i < n; i++) {
+                acc[0] = std::max(acc[0], vals[i]);
+            }
+            result.set(std::max(std::max(acc[0], acc[1]), std::max(acc[2], acc[3])));
+            return;
+        default:
+            for (; i + 4 <= n; i += 4) {
+                for (size_t lane = 0; lane < 4; lane++) {
+                    acc[lane] += vals[i + lane];
+                }
+            }
+            for (; i < n; i++) {
+                acc[0] += vals[i];
+            }
+            double sum = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+            result.set(op == EOp::Avg ? sum / double(n) : sum);
     }
+}
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
+inline void CProgram::apply(EOp op, CSlot &left, const CSlot &right) {
+    if (left.m_kind == CSlot::Number && right.m_kind == CSlot::Number) {
+        double val1 = left.m_number;
+        double val2 = right.m_number;
+        switch (op) {
+            case EOp::Add:
+                left.m_number = val1 + val2;
+                return;
+            case EOp::Sub:
+                left.m_number = val1 - val2;
+                return;
+            case EOp::Mul:
+                left.m_number = val1 * val2;
+                return;
+            case EOp::Div:
+                if (val2 != 0) {
+                    left.m_number = val1 / val2;
+                } else {
+                    left.m_kind = CSlot::Empty;
+                }
+                return;
+            case EOp::Pow:
+                left.m_number = std::pow(val1, val2);
+                return;
+            case EOp::Eq:
+                left.m_number = double(val1 == val2);
+                return;
+            case EOp::Ne:
+                left.m_number = double(val1 != val2);
+                return;
+            case EOp::Lt:
+                left.m_number = double(val1 < val2);
+                return;
+            case EOp::Le:
+                left.m_number = double(val1 <= val2);
+                return;
+            case EOp::Gt:
+                left.m_number = double(val1 > val2);
+                return;
+            case EOp::Ge:
+                left.m_number = double(val1 >= val2);
+                return;
+            default:
+                left.m_kind = CSlot::Empty;
+                return;
+        }
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "*";
-        m_right->save(os);
-        os << ")";
+    bool leftStr = left.m_kind == CSlot::View || left.m_kind == CSlot::Owned;
+    bool rightStr = right.m_kind == CSlot::View || right.m_kind == CSlot::Owned;
+    if (leftStr && rightStr) {
+        // the strings are compared where they are stored, only a concatenation writes into the own buffer
+        const std::string &val1 = left.str();
+        const std::string &val2 = right.str();
+        // the cells with equal text share one interned string
+        bool same = &val1 == &val2;
+        switch (op) {
+            case EOp::Add:
+                left.own() += right.str();
+                return;
+            case EOp::Eq:
+                left.set(double(same || val1 == val2));
+                return;
+            case EOp::Ne:
+                left.set(double(!same && val1 != val2));
+                return;
+            case EOp::Lt:
+                left.set(double(val1 < val2));
+                return;
+            case EOp::Le:
+                left.set(double(val1 <= val2));
+                return;
+            case EOp::Gt:
+                left.set(double(val1 > val2));
+                return;
+            case EOp::Ge:
+                left.set(double(val1 >= val2));
+                return;
+            default:
+                left.m_kind = CSlot::Empty;
+                return;
+        }
     }
 
-private:
-    ANode m_left;
-    ANode m_right;
+    if (op == EOp::Add && left.m_kind == CSlot::Number && rightStr) {
+        left.own() += right.str();
+    } else if (op == EOp::Add && leftStr && right.m_kind == CSlot::Number) {
+        CSlot::appendFixed(left.own(), right.m_number);
+    } else {
+        left.m_kind = CSlot::Empty;
+    }
+}
 
-};
+//----------------------------------------------------------------------------------------------------------------------
 
-/** Derived class from Node representing a division node */
-class opDivNode : public CNode {
+/** Class representing a slab pool the expression nodes of one spreadsheet are allocated from, the memory is
+ * recycled through per-size free lists and returned to the system in bulk when the pool is destroyed, the nodes
+ * may outlive the spreadsheet in its copies, so the pool is locked */
+class CNodePool {
 
 public:
-    opDivNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
+    CNodePool() = default;
 
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
+    CNodePool(const CNodePool &other) = delete;
 
-        if (val1.index() == 1 && val2.index() == 1 && std::get<double>(val2) != 0) {
-            return std::get<double>(val1) / std::get<double>(val2);
-        } else {
-            return {};
-        }
-    }
+    CNodePool &operator=(const CNodePool &other) = delete;
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opDivNode> tmp = std::make_shared<opDivNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
-
-        return tmp;
-    }
-
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
-    }
+    /** Method for allocating a block of memory
+     * @param[in] size - size of the block in bytes
+     * @return pointer to the block
+    */
+    void *allocate(size_t size);
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "/";
-        m_right->save(os);
-        os << ")";
-    }
+    /** Method for returning a block of memory to the pool
+     * @param[in] ptr - pointer to the block
+     * @param[in] size - size of the block in bytes
+    */
+    void deallocate(void *ptr, size_t size);
 
 private:
-    ANode m_left;
-    ANode m_right;
-
+    static constexpr size_t SLAB_SIZE = 64 * 1024;
+    static constexpr size_t GRANULE = 16;
+    static constexpr size_t CLASSES = 16;
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<char[]>> m_slabs;
+    char *m_next = nullptr;
+    size_t m_left = 0;
+    /** Heads of the free lists, one for every multiple of GRANULE, a free block stores the pointer to the next one */
+    std::array<void *, CLASSES> m_free = {};
 };
 
-/** Derived class from Node representing a power node */
-class opPowNode : public CNode {
-
-public:
-    opPowNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
-
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
-
-        if (val1.index() == 1 && val2.index() == 1) {
-            return std::pow(std::get<double>(val1), std::get<double>(val2));
-        } else {
-            return {};
-        }
+inline void *CNodePool::allocate(size_t size) {
+    size_t sizeClass = (size + GRANULE - 1) / GRANULE;
+    if (sizeClass > CLASSES) {
+        return ::operator new(size);
     }
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opPowNode> tmp = std::make_shared<opPowNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
-
-        return tmp;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    void *&head = m_free[sizeClass - 1];
+    if (head) {
+        void *ptr = head;
+        head = *static_cast<void **>(ptr);
+        return ptr;
     }
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
+    size = sizeClass * GRANULE;
+    if (m_left < size) {
+        m_slabs.emplace_back(new char[SLAB_SIZE]);
+        m_next = m_slabs.back().get();
+        m_left = SLAB_SIZE;
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "^";
-        m_right->save(os);
-        os << ")";
+    void *ptr = m_next;
+    m_next += size;
+    m_left -= size;
+
+    return ptr;
+}
+
+inline void CNodePool::deallocate(void *ptr, size_t size) {
+    size_t sizeClass = (size + GRANULE - 1) / GRANULE;
+    if (sizeClass > CLASSES) {
+        ::operator delete(ptr);
+        return;
     }
 
-private:
-    ANode m_left;
-    ANode m_right;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    *static_cast<void **>(ptr) = m_free[sizeClass - 1];
+    m_free[sizeClass - 1] = ptr;
+}
 
-};
+using APool = std::shared_ptr<CNodePool>;
 
-/** Derived class from Node representing a negation node */
-class opNegNode : public CNode {
+/** Class representing an allocator of the expression nodes, the pool is kept alive by every node allocated from it */
+template<typename T>
+class CNodeAllocator {
 
 public:
-    opNegNode(const ANode &left) : m_left(left) {};
+    using value_type = T;
 
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val = m_left->evaluate(visited);
+    CNodeAllocator(APool pool) : m_pool(std::move(pool)) {}
 
-        if (val.index() == 1) {
-            return -std::get<double>(val);
-        } else {
-            return {};
-        }
-    }
+    template<typename U>
+    CNodeAllocator(const CNodeAllocator<U> &other) : m_pool(other.getPool()) {}
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opNegNode> tmp = std::make_shared<opNegNode>(m_left->clone(map));
-        tmp->m_expr = m_expr;
+    T *allocate(size_t n) {
+        return static_cast<T *>(m_pool->allocate(n * sizeof(T)));
+    }
 
-        return tmp;
+    void deallocate(T *ptr, size_t n) {
+        m_pool->deallocate(ptr, n * sizeof(T));
     }
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
+    const APool &getPool() const {
+        return m_pool;
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        os << "-";
-        m_left->save(os);
-        os << ")";
+    bool operator==(const CNodeAllocator &other) const {
+        return m_pool == other.m_pool;
     }
 
 private:
-    ANode m_left;
+    APool m_pool;
 
 };
 
-/** Derived class from Node representing an equality node */
-class opEqNode : public CNode {
+/** Function for creating a node in a pool
+ * @param[in] pool - pool the node is allocated from
+ * @param[in] args - arguments of the constructor of the node
+ * @return shared pointer to the node
+*/
+template<typename T, typename... TArgs>
+std::shared_ptr<T> makeNode(const APool &pool, TArgs &&... args) {
+    return std::allocate_shared<T>(CNodeAllocator<T>(pool), std::forward<TArgs>(args)...);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+/** Base class representing an expression node, the nodes are immutable once built, so they can be shared by the
+ * copies of a cell and by the copies of a spreadsheet */
+class CNode {
 
 public:
-    opEqNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
 
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
+    virtual ~CNode() = default;
 
-        if (val1.index() == 1 && val2.index() == 1) {
-            return double(std::get<double>(val1) == std::get<double>(val2));
-        } else if (val1.index() == 2 && val2.index() == 2) {
-            return double(std::get<std::string>(val1) == std::get<std::string>(val2));
-        } else {
-            return {};
-        }
-    }
+    /** Method for compiling the node into a bytecode program, the positions are compiled as written
+     * @param[out] program - program the instructions are appended to
+    */
+    virtual void compile(CProgram &program) const = 0;
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opEqNode> tmp = std::make_shared<opEqNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
+    /** Method for saving the node
+     * @param[out] out - string the text is appended to
+     * @param[in] offset - offset to be added to the relative positions
+    */
+    virtual void save(std::string &out, const std::pair<int, int> &offset) const = 0;
 
-        return tmp;
-    }
+    /** Method for replaying the node as calls of an expression builder in postfix order, the positions are replayed
+     * as written
+     * @param[out] builder - builder the calls are made on
+    */
+    virtual void replay(CExprBuilder &builder) const = 0;
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
+    /** Method for checking if the value of the node is always a number or empty, never a string
+     * @return true if the node is numeric, false otherwise
+    */
+    virtual bool isNumeric() const {
+        return false;
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "=";
-        m_right->save(os);
-        os << ")";
-    }
+    /** Method for checking if the node is an expression
+     * @return true if the node is an expression, false otherwise
+    */
+    bool isExpr() const;
+
+    /** Method for setting the node as an expression */
+    void setExpr();
 
-private:
-    ANode m_left;
-    ANode m_right;
 
+protected:
+    bool m_expr = false;
 };
 
-/** Derived class from Node representing a non-equality node */
-class opNeNode : public CNode {
+inline bool CNode::isExpr() const {
+    return m_expr;
+}
 
-public:
-    opNeNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
+inline void CNode::setExpr() {
+    m_expr = true;
+}
+
+using ANode = std::shared_ptr<CNode>;
+
+/** Derived class from Node representing a CValue node*/
+class CValueNode : public CNode {
 
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
+public:
+    CValueNode(const CValue &val, bool literal = false) : m_val(val), m_literal(literal) {};
 
-        if (val1.index() == 1 && val2.index() == 1) {
-            return double(std::get<double>(val1) != std::get<double>(val2));
-        } else if (val1.index() == 2 && val2.index() == 2) {
-            return double(std::get<std::string>(val1) != std::get<std::string>(val2));
+    void compile(CProgram &program) const override {
+        if (m_val.index() == 1) {
+            program.emitNumber(std::get<double>(m_val));
         } else {
-            return {};
+            program.emitString(std::get<std::string>(m_val));
         }
     }
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opNeNode> tmp = std::make_shared<opNeNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        // a string literal of a formula is quoted and a negative number parenthesized wherever it is nested, the value
+        // of a cell is written as is
+        if (m_val.index() == 1) {
+            bool parenthesize = m_literal && std::signbit(std::get<double>(m_val));
+            if (parenthesize) {
+                out += '(';
+            }
+            appendNumber(out, std::get<double>(m_val));
+            if (parenthesize) {
+                out += ')';
+            }
+        } else if (m_literal) {
+            out += '"';
+            for (char c: std::get<std::string>(m_val)) {
+                if (c == '"') {
+                    out += '"';
+                }
+                out += c;
+            }
+            out += '"';
+        } else {
+            out += std::get<std::string>(m_val);
+        }
+    }
 
-        return tmp;
+    bool isNumeric() const override {
+        return m_val.index() == 1;
     }
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
+    void replay(CExprBuilder &builder) const override {
+        if (m_val.index() == 1) {
+            builder.valNumber(std::get<double>(m_val));
+        } else {
+            builder.valString(std::get<std::string>(m_val));
+        }
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "<>";
-        m_right->save(os);
-        os << ")";
+    /** Method for getting the value
+     * @return value stored in the node
+    */
+    const CValue &getVal() const {
+        return m_val;
     }
 
 private:
-    ANode m_left;
-    ANode m_right;
+    CValue m_val;
+    /** Whether the value is a literal of a formula rather than the value of a cell */
+    bool m_literal = false;
 
 };
 
-/** Derived class from Node representing a less than node */
-class opLtNode : public CNode {
+/** Derived class from Node representing a reference node */
+class CRefNode : public CNode {
 
 public:
-    opLtNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
+    CRefNode(const CPos &pos) : m_pos(pos) {}
 
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
+    void compile(CProgram &program) const override {
+        program.emitRef(m_pos);
+    }
 
-        if (val1.index() == 1 && val2.index() == 1) {
-            return double(std::get<double>(val1) < std::get<double>(val2));
-        } else if (val1.index() == 2 && val2.index() == 2) {
-            return double(std::get<std::string>(val1) < std::get<std::string>(val2));
-        } else {
-            return {};
-        }
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        CPos pos = m_pos;
+        pos.updatePos(offset);
+        pos.toStr(out);
+    }
+
+    void replay(CExprBuilder &builder) const override {
+        std::string str;
+        m_pos.toStr(str);
+        builder.valReference(str);
     }
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opLtNode> tmp = std::make_shared<opLtNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
+private:
+    CPos m_pos;
+
+};
+
+/** Derived class from Node representing an addition node */
+class opAddNode : public CNode {
+
+public:
+    opAddNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-        return tmp;
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Add);
     }
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opAdd();
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "<";
-        m_right->save(os);
-        os << ")";
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += '+';
+        m_right->save(out, offset);
+        out += ')';
     }
 
 private:
@@ -762,43 +1201,34 @@ private:
 
 };
 
-/** Derived class from Node representing a less than or equal node */
-class opLeNode : public CNode {
+/** Derived class from Node representing a subtraction node */
+class opSubNode : public CNode {
 
 public:
-    opLeNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
-
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
+    opSubNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-        if (val1.index() == 1 && val2.index() == 1) {
-            return double(std::get<double>(val1) <= std::get<double>(val2));
-        } else if (val1.index() == 2 && val2.index() == 2) {
-            return double(std::get<std::string>(val1) <= std::get<std::string>(val2));
-        } else {
-            return {};
-        }
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Sub);
     }
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opLeNode> tmp = std::make_shared<opLeNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
-
-        return tmp;
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opSub();
     }
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += '-';
+        m_right->save(out, offset);
+        out += ')';
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "<=";
-        m_right->save(os);
-        os << ")";
+    bool isNumeric() const override {
+        return true;
     }
 
 private:
@@ -807,43 +1237,34 @@ private:
 
 };
 
-/** Derived class from Node representing a greater than node */
-class opGtNode : public CNode {
+/** Derived class from Node representing a multiplication node */
+class opMulNode : public CNode {
 
 public:
-    opGtNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
-
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
+    opMulNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-        if (val1.index() == 1 && val2.index() == 1) {
-            return double(std::get<double>(val1) > std::get<double>(val2));
-        } else if (val1.index() == 2 && val2.index() == 2) {
-            return double(std::get<std::string>(val1) > std::get<std::string>(val2));
-        } else {
-            return {};
-        }
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Mul);
     }
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opGtNode> tmp = std::make_shared<opGtNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
-
-        return tmp;
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opMul();
     }
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += '*';
+        m_right->save(out, offset);
+        out += ')';
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << ">";
-        m_right->save(os);
-        os << ")";
+    bool isNumeric() const override {
+        return true;
     }
 
 private:
@@ -852,43 +1273,34 @@ private:
 
 };
 
-/** Derived class from Node representing a greater than or equal node */
-class opGeNode : public CNode {
+/** Derived class from Node representing a division node */
+class opDivNode : public CNode {
 
 public:
-    opGeNode(const ANode &left, const ANode &right) : m_left(left), m_right(right) {};
-
-    CValue evaluate(std::set<CPos> &visited) const override {
-        CValue val1 = m_left->evaluate(visited);
-        CValue val2 = m_right->evaluate(visited);
+    opDivNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-        if (val1.index() == 1 && val2.index() == 1) {
-            return double(std::get<double>(val1) >= std::get<double>(val2));
-        } else if (val1.index() == 2 && val2.index() == 2) {
-            return double(std::get<std::string>(val1) >= std::get<std::string>(val2));
-        } else {
-            return {};
-        }
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Div);
     }
 
-    std::shared_ptr<CNode> clone(const std::map<CPos, ANode> &map) const override {
-        std::shared_ptr<opGeNode> tmp = std::make_shared<opGeNode>(m_left->clone(map), m_right->clone(map));
-        tmp->m_expr = m_expr;
-
-        return tmp;
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opDiv();
     }
 
-    void updateRef(std::pair<int, int> offset) override {
-        m_left->updateRef(offset);
-        m_right->updateRef(offset);
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += '/';
+        m_right->save(out, offset);
+        out += ')';
     }
 
-    void save(std::ostream &os) const override {
-        os << "(";
-        m_left->save(os);
-        os << "<=";
-        m_right->save(os);
-        os << ")";
+    bool isNumeric() const override {
+        return true;
     }
 
 private:
@@ -897,377 +1309,3857 @@ private:
 
 };
 
-//----------------------------------------------------------------------------------------------------------------------
+/** Derived class from Node representing a power node */
+class opPowNode : public CNode {
 
-/** Derived class from CExprBuilder representing my expression builder */
-class CMyExprBuilder : public CExprBuilder {
 public:
+    opPowNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-    CMyExprBuilder() = default;
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Pow);
+    }
 
-    CMyExprBuilder(const CMyExprBuilder &other);
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opPow();
+    }
 
-    CMyExprBuilder &operator=(const CMyExprBuilder &other);
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += '^';
+        m_right->save(out, offset);
+        out += ')';
+    }
 
-    /** Method for creating an addition node */
-    void opAdd() override;
+    bool isNumeric() const override {
+        return true;
+    }
 
-    /** Method for creating a subtraction node */
-    void opSub() override;
+private:
+    ANode m_left;
+    ANode m_right;
 
-    /** Method for creating a multiplication node */
-    void opMul() override;
+};
 
-    /** Method for creating a division node */
-    void opDiv() override;
+/** Derived class from Node representing a negation node */
+class opNegNode : public CNode {
 
-    /** Method for creating a power node */
-    void opPow() override;
+public:
+    opNegNode(ANode left) : m_left(std::move(left)) {};
 
-    /** Method for creating a negation node */
-    void opNeg() override;
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        program.emit(EOp::Neg);
+    }
 
-    /** Method for creating an equality node */
-    void opEq() override;
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        builder.opNeg();
+    }
 
-    /** Method for creating a non-equality node */
-    void opNe() override;
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        out += '-';
+        m_left->save(out, offset);
+        out += ')';
+    }
 
-    /** Method for creating a less than node */
-    void opLt() override;
+    bool isNumeric() const override {
+        return true;
+    }
 
-    /** Method for creating a less than or equal node */
-    void opLe() override;
+private:
+    ANode m_left;
 
-    /** Method for creating a greater than node */
-    void opGt() override;
+};
 
-    /** Method for creating a greater than or equal node */
-    void opGe() override;
+/** Derived class from Node representing an equality node */
+class opEqNode : public CNode {
 
-    /** Method creating CValueNode with a number
-     * @param[in] val - number to be stored in the node
-    */
-    void valNumber(double val) override;
+public:
+    opEqNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-    /** Method creating CValueNode with a string
-     * @param[in] val - string to be stored in the node
-    */
-    void valString(std::string val) override;
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Eq);
+    }
 
-    /** Method creating CRefNode with a reference to another cell
-     * @param[in] val - reference to be stored in the node
-    */
-    void valReference(std::string val) override;
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opEq();
+    }
 
-    void valRange(std::string val) override {}
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += '=';
+        m_right->save(out, offset);
+        out += ')';
+    }
 
-    void funcCall(std::string fnName, int paramCount) override {}
+    bool isNumeric() const override {
+        return true;
+    }
 
-    /** Method for getting the value of a cell
-     * @param[in] pos - position of the cell
-     * @return value of the cell
-    */
-    CValue getVal(const CPos &pos) const;
+private:
+    ANode m_left;
+    ANode m_right;
 
-    /** Method for updating the nodes
-     * @param[in] pos - position of the cell
-     * @param[in] contents - contents of the cell
-    */
-    void updateNodes(const CPos &pos, const std::string &contents);
+};
 
-    /** Method for checking if a node exists
-     * @param[in] pos - position of the cell
-     * @return true if the node exists, false otherwise
-    */
-    bool nodeExists(const CPos &pos) const;
+/** Derived class from Node representing a non-equality node */
+class opNeNode : public CNode {
 
-    /** Method for adding a CValueNode to the map
-     * @param[in] pos - position of the cell
-     * @param[in] val - value of the cell
-    */
-    void addCValNode(const CPos &pos, const CValue &val);
+public:
+    opNeNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-    /** Method for adding a node to the map
-     * @param[in] pos - position of the cell
-     * @param[in] tmp - reference to the cell
-    */
-    void addNode(const CPos &dst, const ANode &tmp);
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Ne);
+    }
 
-    /** Method for updating the references
-     * @param[in] pos - position of the cell
-     * @param[in] offset - offset to be added to the position
-    */
-    void callUpdateRef(const CPos &pos, const std::pair<int, int> &offset);
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opNe();
+    }
 
-    /** Method for getting the nodes
-     * @return map of the nodes
-    */
-    const std::map<CPos, ANode> &getNodes() const;
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += "<>";
+        m_right->save(out, offset);
+        out += ')';
+    }
 
-private:
+    bool isNumeric() const override {
+        return true;
+    }
 
-    std::stack<ANode> m_stack;
-    std::map<CPos, ANode> m_nodes;
+private:
+    ANode m_left;
+    ANode m_right;
 
-    /** Static method for adding double quotes to a string
-     * @param[out] val - string to be modified
-    */
-    static void doubleQuotes(std::string &val);
 };
 
-CMyExprBuilder::CMyExprBuilder(const CMyExprBuilder &other) {
-    for (const auto &pair: other.m_nodes) {
-        m_nodes[pair.first] = pair.second->clone(m_nodes);
-    }
-}
+/** Derived class from Node representing a less than node */
+class opLtNode : public CNode {
 
-CMyExprBuilder &CMyExprBuilder::operator=(const CMyExprBuilder &other) {
-    if (this != &other) {
-        m_nodes.clear();
-        for (const auto &pair: other.m_nodes) {
-            m_nodes[pair.first] = pair.second->clone(m_nodes);
-        }
-    }
+public:
+    opLtNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-    return *this;
-}
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Lt);
+    }
 
-void CMyExprBuilder::opAdd() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot add only one element");
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opLt();
     }
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opAddNode>(left, right));
-}
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += '<';
+        m_right->save(out, offset);
+        out += ')';
+    }
 
-void CMyExprBuilder::opSub() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot subtract only one element");
+    bool isNumeric() const override {
+        return true;
     }
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opSubNode>(left, right));
-}
+private:
+    ANode m_left;
+    ANode m_right;
 
-void CMyExprBuilder::opMul() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot multiply only one element");
-    }
+};
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opMulNode>(left, right));
-}
+/** Derived class from Node representing a less than or equal node */
+class opLeNode : public CNode {
 
-void CMyExprBuilder::opDiv() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot divide only one element");
-    }
+public:
+    opLeNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opDivNode>(left, right));
-}
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Le);
+    }
 
-void CMyExprBuilder::opPow() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot power only one element");
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opLe();
     }
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opPowNode>(left, right));
-}
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += "<=";
+        m_right->save(out, offset);
+        out += ')';
+    }
 
-void CMyExprBuilder::opNeg() {
-    if (m_stack.empty()) {
-        throw std::invalid_argument("Cannot negate only zero elements");
+    bool isNumeric() const override {
+        return true;
     }
 
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opNegNode>(left));
-}
+private:
+    ANode m_left;
+    ANode m_right;
+
+};
+
+/** Derived class from Node representing a greater than node */
+class opGtNode : public CNode {
+
+public:
+    opGtNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
+
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Gt);
+    }
+
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opGt();
+    }
+
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += '>';
+        m_right->save(out, offset);
+        out += ')';
+    }
+
+    bool isNumeric() const override {
+        return true;
+    }
+
+private:
+    ANode m_left;
+    ANode m_right;
+
+};
+
+/** Derived class from Node representing a greater than or equal node */
+class opGeNode : public CNode {
+
+public:
+    opGeNode(ANode left, ANode right) : m_left(std::move(left)), m_right(std::move(right)) {};
+
+    void compile(CProgram &program) const override {
+        m_left->compile(program);
+        m_right->compile(program);
+        program.emit(EOp::Ge);
+    }
+
+    void replay(CExprBuilder &builder) const override {
+        m_left->replay(builder);
+        m_right->replay(builder);
+        builder.opGe();
+    }
+
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += '(';
+        m_left->save(out, offset);
+        out += ">=";
+        m_right->save(out, offset);
+        out += ')';
+    }
+
+    bool isNumeric() const override {
+        return true;
+    }
+
+private:
+    ANode m_left;
+    ANode m_right;
+
+};
+
+/** Derived class from Node representing a range of cells */
+class CRangeNode : public CNode {
+
+public:
+    CRangeNode(const CPos &from, const CPos &to) : m_from(from), m_to(to) {}
+
+    void compile(CProgram &program) const override {
+        program.emit(EOp::Range, compileRange(program));
+    }
+
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        CPos from = m_from, to = m_to;
+        from.updatePos(offset);
+        to.updatePos(offset);
+        from.toStr(out);
+        out += ':';
+        to.toStr(out);
+    }
+
+    void replay(CExprBuilder &builder) const override {
+        std::string str;
+        m_from.toStr(str);
+        str += ':';
+        m_to.toStr(str);
+        builder.valRange(str);
+    }
+
+    /** Method for adding the range to a program
+     * @param[out] program - program the range is added to
+     * @return index of the range
+    */
+    uint32_t compileRange(CProgram &program) const {
+        return program.addRange(m_from, m_to);
+    }
+
+private:
+    CPos m_from;
+    CPos m_to;
+
+};
+
+/** Derived class from Node representing a function call, the aggregate functions take a range as the last argument */
+class CFuncNode : public CNode {
+
+public:
+    CFuncNode(EOp op, const std::string &name, std::vector<ANode> args) : m_op(op), m_name(name),
+                                                                          m_args(std::move(args)) {};
+
+    void compile(CProgram &program) const override {
+        if (m_op == EOp::If) {
+            for (const ANode &arg: m_args) {
+                arg->compile(program);
+            }
+            program.emit(EOp::If);
+            return;
+        }
+
+        for (size_t i = 0; i + 1 < m_args.size(); i++) {
+            m_args[i]->compile(program);
+        }
+        program.emit(m_op, static_cast<const CRangeNode &>(*m_args.back()).compileRange(program));
+    }
+
+    void save(std::string &out, const std::pair<int, int> &offset) const override {
+        out += m_name;
+        out += '(';
+        for (size_t i = 0; i < m_args.size(); i++) {
+            if (i > 0) {
+                out += ',';
+            }
+            m_args[i]->save(out, offset);
+        }
+        out += ')';
+    }
+
+    void replay(CExprBuilder &builder) const override {
+        for (const ANode &arg: m_args) {
+            arg->replay(builder);
+        }
+        builder.funcCall(m_name, int(m_args.size()));
+    }
+
+    bool isNumeric() const override {
+        return m_op != EOp::If;
+    }
+
+private:
+    EOp m_op;
+    std::string m_name;
+    std::vector<ANode> m_args;
+
+};
+
+//----------------------------------------------------------------------------------------------------------------------
+
+/** Struct representing a cell of the spreadsheet together with its cached value. The value may be computed by several
+ * readers at once, only the one moving the state from dirty to writing stores it and a clean value is never changed
+ * until a writer marks the cell dirty again, so a clean value is read without locking. */
+struct CCell {
+    /** States of the cached value */
+    enum EState : uint8_t {
+        Dirty, Writing, Clean
+    };
+
+    CCell() = default;
+
+    /** Copy constructor, a value being computed by a reader of the source is not copied and the copy stays dirty
+     * @param[in] other - cell to be copied
+    */
+    CCell(const CCell &other);
+
+    CCell(CCell &&other) noexcept;
+
+    CCell &operator=(const CCell &other);
+
+    CCell &operator=(CCell &&other) noexcept;
+
+    /** Method for checking if the cached value is not computed yet, a value cell is read from its node and never dirty
+     * @return true if the value is not clean, false otherwise
+    */
+    bool isDirty() const;
+
+    /** Method for marking the cached value as not computed, only called with no reader of the cell */
+    void markDirty();
+
+    /** Method for storing a computed value unless another reader stored it first
+     * @param[in] value - computed value
+     * @return reference to the cached value
+    */
+    const CValue &publish(CValue value) const;
+
+    /** Formula and its program, both shared by the copies of the cell, a value cell has no program */
+    ANode m_node;
+    std::shared_ptr<const CProgram> m_program;
+    /** Offset added to the relative positions of the formula */
+    std::pair<int, int> m_offset = {0, 0};
+    /** Keys of the positions referenced by the node, sorted and without duplicates */
+    std::vector<uint64_t> m_refs;
+    /** Ranges referenced by the node */
+    std::vector<CRange> m_ranges;
+    mutable CValue m_value;
+    mutable std::atomic<uint8_t> m_state = Dirty;
+    /** Whether the cell is part of a reference cycle */
+    bool m_cyclic = false;
+};
+
+inline CCell::CCell(const CCell &other) {
+    *this = other;
+}
+
+inline CCell::CCell(CCell &&other) noexcept {
+    *this = std::move(other);
+}
+
+inline CCell &CCell::operator=(const CCell &other) {
+    m_node = other.m_node;
+    m_program = other.m_program;
+    m_offset = other.m_offset;
+    m_refs = other.m_refs;
+    m_ranges = other.m_ranges;
+    m_cyclic = other.m_cyclic;
+    // the source may live in a tile shared with a copy of the spreadsheet read on another thread
+    uint8_t state = other.m_state.load(std::memory_order_acquire);
+    m_value = state == Clean ? other.m_value : CValue();
+    m_state.store(state == Clean ? Clean : Dirty, std::memory_order_relaxed);
+    return *this;
+}
+
+inline CCell &CCell::operator=(CCell &&other) noexcept {
+    m_node = std::move(other.m_node);
+    m_program = std::move(other.m_program);
+    m_offset = other.m_offset;
+    m_refs = std::move(other.m_refs);
+    m_ranges = std::move(other.m_ranges);
+    m_cyclic = other.m_cyclic;
+    uint8_t state = other.m_state.load(std::memory_order_acquire);
+    m_value = state == Clean ? std::move(other.m_value) : CValue();
+    m_state.store(state == Clean ? Clean : Dirty, std::memory_order_relaxed);
+    return *this;
+}
+
+inline bool CCell::isDirty() const {
+    return m_program && m_state.load(std::memory_order_acquire) != Clean;
+}
+
+inline void CCell::markDirty() {
+    m_state.store(Dirty, std::memory_order_relaxed);
+}
+
+inline const CValue &CCell::publish(CValue value) const {
+    uint8_t expected = Dirty;
+    if (m_state.compare_exchange_strong(expected, Writing, std::memory_order_acquire)) {
+        m_value = std::move(value);
+        m_state.store(Clean, std::memory_order_release);
+        return m_value;
+    }
+
+    // another reader is storing the same value, it does not evaluate anything meanwhile
+    while (m_state.load(std::memory_order_acquire) != Clean) {
+        std::this_thread::yield();
+    }
+    return m_value;
+}
+
+/** Class representing an open addressing hash table keyed by packed positions, the values are stored densely in the
+ * order of insertion and the probed slots only keep the keys and the indices of the values */
+template<typename T>
+class CKeyTable {
+
+public:
+    using CEntry = std::pair<uint64_t, T>;
+
+    /** Method for finding a value
+     * @param[in] key - key of the position
+     * @return pointer to the value, nullptr if it does not exist
+    */
+    T *find(uint64_t key);
+
+    const T *find(uint64_t key) const;
+
+    /** Method for accessing a value, a default one is inserted if it does not exist
+     * @param[in] key - key of the position
+     * @return reference to the value, it is valid until the next insertion
+    */
+    T &operator[](uint64_t key);
+
+    /** Method for getting the number of the values
+     * @return number of the values
+    */
+    size_t size() const;
+
+    /** Method for preparing the table for a number of the values, so that inserting them does not rehash
+     * @param[in] count - number of the values
+    */
+    void reserve(size_t count);
+
+    typename std::vector<CEntry>::iterator begin();
+
+    typename std::vector<CEntry>::iterator end();
+
+    typename std::vector<CEntry>::const_iterator begin() const;
+
+    typename std::vector<CEntry>::const_iterator end() const;
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    /** Struct representing a slot of the table */
+    struct CSlot {
+        uint64_t m_key = 0;
+        uint32_t m_index = EMPTY;
+    };
+
+    std::vector<CSlot> m_slots;
+    std::vector<CEntry> m_entries;
+    /** Shift turning the upper bits of the hash into a slot index */
+    unsigned m_shift = 64;
+
+    /** Method for finding the slot of a key using linear probing
+     * @param[in] key - key of the position
+     * @return index of the slot holding the key, or of the empty slot where it belongs
+    */
+    size_t probe(uint64_t key) const;
+
+    /** Method for resizing the slots
+     * @param[in] capacity - new number of the slots, a power of two
+    */
+    void rehash(size_t capacity);
+};
+
+template<typename T>
+T *CKeyTable<T>::find(uint64_t key) {
+    return const_cast<T *>(static_cast<const CKeyTable *>(this)->find(key));
+}
+
+template<typename T>
+const T *CKeyTable<T>::find(uint64_t key) const {
+    if (m_slots.empty()) {
+        return nullptr;
+    }
+
+    const CSlot &slot = m_slots[probe(key)];
+    if (slot.m_index == EMPTY) {
+        return nullptr;
+    }
+
+    return &m_entries[slot.m_index].second;
+}
+
+template<typename T>
+T &CKeyTable<T>::operator[](uint64_t key) {
+    if ((m_entries.size() + 1) * 2 > m_slots.size()) {
+        rehash(std::max<size_t>(16, m_slots.size() * 2));
+    }
+
+    CSlot &slot = m_slots[probe(key)];
+    if (slot.m_index == EMPTY) {
+        slot = {key, uint32_t(m_entries.size())};
+        m_entries.emplace_back(key, T());
+    }
+
+    return m_entries[slot.m_index].second;
+}
+
+template<typename T>
+size_t CKeyTable<T>::size() const {
+    return m_entries.size();
+}
+
+template<typename T>
+void CKeyTable<T>::reserve(size_t count) {
+    size_t capacity = 16;
+    while (capacity < (count + 1) * 2) {
+        capacity *= 2;
+    }
+    if (capacity > m_slots.size()) {
+        rehash(capacity);
+    }
+    m_entries.reserve(count);
+}
+
+template<typename T>
+typename std::vector<typename CKeyTable<T>::CEntry>::iterator CKeyTable<T>::begin() {
+    return m_entries.begin();
+}
+
+template<typename T>
+typename std::vector<typename CKeyTable<T>::CEntry>::iterator CKeyTable<T>::end() {
+    return m_entries.end();
+}
+
+template<typename T>
+typename std::vector<typename CKeyTable<T>::CEntry>::const_iterator CKeyTable<T>::begin() const {
+    return m_entries.begin();
+}
+
+template<typename T>
+typename std::vector<typename CKeyTable<T>::CEntry>::const_iterator CKeyTable<T>::end() const {
+    return m_entries.end();
+}
+
+template<typename T>
+size_t CKeyTable<T>::probe(uint64_t key) const {
+    size_t mask = m_slots.size() - 1;
+    // Fibonacci hashing spreads consecutive rows and columns over the whole table
+    for (size_t i = (key * 0x9E3779B97F4A7C15ull) >> m_shift;; i = (i + 1) & mask) {
+        if (m_slots[i].m_index == EMPTY || m_slots[i].m_key == key) {
+            return i;
+        }
+    }
+}
+
+template<typename T>
+void CKeyTable<T>::rehash(size_t capacity) {
+    m_slots.assign(capacity, CSlot());
+    m_shift = 64;
+    for (size_t i = capacity; i > 1; i >>= 1) {
+        m_shift--;
+    }
+
+    for (uint32_t i = 0; i < m_entries.size(); i++) {
+        m_slots[probe(m_entries[i].first)] = {m_entries[i].first, i};
+    }
+}
+
+using CCellEntry = std::pair<uint64_t, CCell>;
+
+/** Class representing a tile of 64x64 cells, the cells are stored densely in the order of insertion and a slot for
+ * every position of the tile holds the index of its cell, the slots of one column are next to each other */
+class CTile {
+
+public:
+    static constexpr unsigned BITS = 6;
+    static constexpr uint64_t SIZE = 1 << BITS;
+
+    /** Method for finding a cell
+     * @param[in] key - key of the position, it has to lie in the tile
+     * @return pointer to the cell, nullptr if it does not exist
+    */
+    CCell *find(uint64_t key);
+
+    const CCell *find(uint64_t key) const;
+
+    /** Method for accessing a cell, a default one is inserted if it does not exist
+     * @param[in] key - key of the position, it has to lie in the tile
+     * @param[out] inserted - set to true if the cell was inserted
+     * @return reference to the cell, it is valid until the next insertion into the tile
+    */
+    CCell &get(uint64_t key, bool &inserted);
+
+    /** Method for getting the index of a cell among the cells of the tile
+     * @param[in] key - key of the position, it has to lie in the tile
+     * @return index of the cell, SIZE * SIZE if it does not exist
+    */
+    size_t indexOf(uint64_t key) const;
+
+    /** Method for getting the cells of the tile
+     * @return cells in the order of insertion
+    */
+    std::vector<CCellEntry> &getCells();
+
+    const std::vector<CCellEntry> &getCells() const;
+
+    /** Method for visiting the cells in a rectangle clipped to the tile, column by column
+     * @param[in] col1, row1 - first column and row of the rectangle
+     * @param[in] col2, row2 - column and row just past the rectangle
+     * @param[in] fn - function called with the key and the cell
+    */
+    template<typename TFn>
+    void forEachInRect(uint64_t col1, uint64_t row1, uint64_t col2, uint64_t row2, const TFn &fn) const;
+
+private:
+    /** Index of the cell plus one, zero for an empty slot */
+    std::array<uint16_t, SIZE * SIZE> m_slots = {};
+    std::vector<CCellEntry> m_cells;
+
+    /** Static method for getting the slot of a position
+     * @param[in] col, row - column and row of the position
+     * @return index of the slot
+    */
+    static size_t slotOf(uint64_t col, uint64_t row);
+};
+
+inline CCell *CTile::find(uint64_t key) {
+    return const_cast<CCell *>(static_cast<const CTile *>(this)->find(key));
+}
+
+inline const CCell *CTile::find(uint64_t key) const {
+    uint16_t slot = m_slots[slotOf(key >> 32, key & UINT32_MAX)];
+
+    return slot ? &m_cells[slot - 1].second : nullptr;
+}
+
+inline CCell &CTile::get(uint64_t key, bool &inserted) {
+    uint16_t &slot = m_slots[slotOf(key >> 32, key & UINT32_MAX)];
+    inserted = !slot;
+    if (inserted) {
+        m_cells.emplace_back(key, CCell());
+        slot = uint16_t(m_cells.size());
+    }
+
+    return m_cells[slot - 1].second;
+}
+
+inline size_t CTile::indexOf(uint64_t key) const {
+    uint16_t slot = m_slots[slotOf(key >> 32, key & UINT32_MAX)];
+
+    return slot ? slot - 1 : SIZE * SIZE;
+}
+
+inline std::vector<CCellEntry> &CTile::getCells() {
+    return m_cells;
+}
+
+inline const std::vector<CCellEntry> &CTile::getCells() const {
+    return m_cells;
+}
+
+template<typename TFn>
+void CTile::forEachInRect(uint64_t col1, uint64_t row1, uint64_t col2, uint64_t row2, const TFn &fn) const {
+    for (uint64_t col = col1; col < col2; col++) {
+        const uint16_t *slots = &m_slots[slotOf(col, 0)];
+        for (uint64_t row = row1; row < row2; row++) {
+            if (uint16_t slot = slots[row % SIZE]) {
+                fn(m_cells[slot - 1].first, m_cells[slot - 1].second);
+            }
+        }
+    }
+}
+
+inline size_t CTile::slotOf(uint64_t col, uint64_t row) {
+    return (col % SIZE) * SIZE + row % SIZE;
+}
+
+/** Class representing the cells of the spreadsheet split into tiles of 64x64 cells, the tiles are allocated on demand
+ * and found through a hash table, so that far apart cells do not waste memory, copies of the grid share the tiles
+ * and a shared tile is cloned before it is modified */
+class CCellGrid {
+
+public:
+
+    /** Method for finding a cell to be modified, its tile stops being shared
+     * @param[in] key - key of the position
+     * @return pointer to the cell, nullptr if it does not exist
+    */
+    CCell *find(uint64_t key);
+
+    const CCell *find(uint64_t key) const;
+
+    /** Method for accessing a cell to be modified, a default one is inserted if it does not exist
+     * @param[in] key - key of the position
+     * @return reference to the cell, it is valid until the next insertion
+    */
+    CCell &operator[](uint64_t key);
+
+    /** Method for getting the number of the cells
+     * @return number of the cells
+    */
+    size_t size() const;
+
+    /** Method for visiting all cells, tile by tile
+     * @param[in] fn - function called with the key and the cell
+    */
+    template<typename TFn>
+    void forEach(const TFn &fn) const;
+
+    /** Method for visiting the existing cells in a rectangle, tile by tile
+     * @param[in] pos - position of the top-left corner of the rectangle
+     * @param[in] w - width of the rectangle
+     * @param[in] h - height of the rectangle
+     * @param[in] fn - function called with the key and the cell
+    */
+    template<typename TFn>
+    void forEachInRect(const CPos &pos, size_t w, size_t h, const TFn &fn) const;
+
+    /** Method for visiting the existing cells of a range, tile by tile
+     * @param[in] range - range of the cells
+     * @param[in] fn - function called with the key and the cell
+    */
+    template<typename TFn>
+    void forEachInRange(const CRange &range, const TFn &fn) const;
+
+    /** Method for numbering the cells densely in the order forEach visits them, a cell gets the first number of its
+     * tile plus its index in the tile
+     * @return first numbers of the tiles together with the tiles, keyed by the tiles
+    */
+    CKeyTable<std::pair<uint32_t, const CTile *>> numberCells() const;
+
+    /** Static method for getting the number of a cell
+     * @param[in] numbers - first numbers of the tiles returned by numberCells
+     * @param[in] key - key of the position
+     * @return number of the cell, UINT32_MAX if it does not exist
+    */
+    static uint32_t numberOf(const CKeyTable<std::pair<uint32_t, const CTile *>> &numbers, uint64_t key);
+
+    /** Static method for getting the key of the tile containing a position
+     * @param[in] key - key of the position
+     * @return key made of the column and the row of the tile
+    */
+    static uint64_t tileOf(uint64_t key);
+
+private:
+    CKeyTable<std::shared_ptr<CTile>> m_tiles;
+    size_t m_size = 0;
+
+    /** Static method for getting a tile to be modified
+     * @param[in,out] tile - tile, it is replaced by its clone if it is shared
+     * @return reference to the tile
+    */
+    static CTile &unshare(std::shared_ptr<CTile> &tile);
+};
+
+inline CCell *CCellGrid::find(uint64_t key) {
+    std::shared_ptr<CTile> *tile = m_tiles.find(tileOf(key));
+    if (!tile || !(*tile)->find(key)) {
+        return nullptr;
+    }
+
+    return unshare(*tile).find(key);
+}
+
+inline const CCell *CCellGrid::find(uint64_t key) const {
+    const std::shared_ptr<CTile> *tile = m_tiles.find(tileOf(key));
+
+    return tile ? (*tile)->find(key) : nullptr;
+}
+
+inline CCell &CCellGrid::operator[](uint64_t key) {
+    std::shared_ptr<CTile> &tile = m_tiles[tileOf(key)];
+    if (!tile) {
+        tile = std::make_shared<CTile>();
+    }
+
+    bool inserted;
+    CCell &cell = unshare(tile).get(key, inserted);
+    m_size += inserted;
+
+    return cell;
+}
+
+inline size_t CCellGrid::size() const {
+    return m_size;
+}
+
+template<typename TFn>
+void CCellGrid::forEach(const TFn &fn) const {
+    for (const auto &entry: m_tiles) {
+        for (const CCellEntry &cell: entry.second->getCells()) {
+            fn(cell.first, cell.second);
+        }
+    }
+}
+
+template<typename TFn>
+void CCellGrid::forEachInRect(const CPos &pos, size_t w, size_t h, const TFn &fn) const {
+    uint64_t col1 = pos.getCol(), row1 = pos.getRow();
+    uint64_t col2 = col1 + w, row2 = row1 + h;
+
+    for (uint64_t tileCol = col1 / CTile::SIZE; tileCol * CTile::SIZE < col2; tileCol++) {
+        for (uint64_t tileRow = row1 / CTile::SIZE; tileRow * CTile::SIZE < row2; tileRow++) {
+            const std::shared_ptr<CTile> *tile = m_tiles.find(tileCol << 32 | tileRow);
+            if (tile) {
+                (*tile)->forEachInRect(std::max(col1, tileCol * CTile::SIZE), std::max(row1, tileRow * CTile::SIZE),
+                                       std::min(col2, (tileCol + 1) * CTile::SIZE),
+                                       std::min(row2, (tileRow + 1) * CTile::SIZE), fn);
+            }
+        }
+    }
+}
+
+template<typename TFn>
+void CCellGrid::forEachInRange(const CRange &range, const TFn &fn) const {
+    if (range.m_from == CPos::INVALID_KEY) {
+        return;
+    }
+
+    CPos from = CPos::fromKey(range.m_from), to = CPos::fromKey(range.m_to);
+    forEachInRect(from, to.getCol() - from.getCol() + 1, to.getRow() - from.getRow() + 1, fn);
+}
+
+inline CKeyTable<std::pair<uint32_t, const CTile *>> CCellGrid::numberCells() const {
+    CKeyTable<std::pair<uint32_t, const CTile *>> numbers;
+    numbers.reserve(m_tiles.size());
+    uint32_t next = 0;
+    for (const auto &entry: m_tiles) {
+        numbers[entry.first] = {next, entry.second.get()};
+        next += uint32_t(entry.second->getCells().size());
+    }
+
+    return numbers;
+}
+
+inline uint32_t CCellGrid::numberOf(const CKeyTable<std::pair<uint32_t, const CTile *>> &numbers, uint64_t key) {
+    const std::pair<uint32_t, const CTile *> *tile = numbers.find(tileOf(key));
+    if (!tile) {
+        return UINT32_MAX;
+    }
+
+    size_t index = tile->second->indexOf(key);
+
+    return index == CTile::SIZE * CTile::SIZE ? UINT32_MAX : tile->first + uint32_t(index);
+}
+
+inline uint64_t CCellGrid::tileOf(uint64_t key) {
+    return (key >> 32) / CTile::SIZE << 32 | (key & UINT32_MAX) / CTile::SIZE;
+}
+
+inline CTile &CCellGrid::unshare(std::shared_ptr<CTile> &tile) {
+    if (tile.use_count() > 1) {
+        tile = std::make_shared<CTile>(*tile);
+    }
+
+    return *tile;
+}
+
+/** Class representing an index from positions to the sets of the cells depending on them, it is split into shards by
+ * the tiles of the positions, copies of the index share the shards and a shared shard is cloned before it is modified */
+class CDependencyIndex {
+
+public:
+    using CSet = std::unordered_set<uint64_t>;
+
+    /** Method for finding the cells depending on a position
+     * @param[in] key - key of the position
+     * @return pointer to the set of the keys of the cells, nullptr if there are none
+    */
+    const CSet *find(uint64_t key) const;
+
+    /** Method for adding a dependent cell
+     * @param[in] key - key of the position
+     * @param[in] cell - key of the cell depending on the position
+    */
+    void insert(uint64_t key, uint64_t cell);
+
+    /** Method for removing a dependent cell
+     * @param[in] key - key of the position
+     * @param[in] cell - key of the cell no longer depending on the position
+    */
+    void erase(uint64_t key, uint64_t cell);
+
+private:
+    using CShard = std::unordered_map<uint64_t, CSet>;
+
+    CKeyTable<std::shared_ptr<CShard>> m_shards;
+};
+
+inline const CDependencyIndex::CSet *CDependencyIndex::find(uint64_t key) const {
+    const std::shared_ptr<CShard> *shard = m_shards.find(CCellGrid::tileOf(key));
+    if (!shard) {
+        return nullptr;
+    }
+
+    auto it = (*shard)->find(key);
+
+    return it != (*shard)->end() ? &it->second : nullptr;
+}
+
+inline void CDependencyIndex::insert(uint64_t key, uint64_t cell) {
+    std::shared_ptr<CShard> &shard = m_shards[CCellGrid::tileOf(key)];
+    if (!shard) {
+        shard = std::make_shared<CShard>();
+    } else if (shard.use_count() > 1) {
+        shard = std::make_shared<CShard>(*shard);
+    }
+
+    (*shard)[key].insert(cell);
+}
+
+inline void CDependencyIndex::erase(uint64_t key, uint64_t cell) {
+    std::shared_ptr<CShard> *shard = m_shards.find(CCellGrid::tileOf(key));
+    if (!shard || !*shard) {
+        return;
+    }
+
+    if (shard->use_count() > 1) {
+        *shard = std::make_shared<CShard>(**shard);
+    }
+
+    auto it = (*shard)->find(key);
+    if (it != (*shard)->end()) {
+        it->second.erase(cell);
+        if (it->second.empty()) {
+            (*shard)->erase(it);
+        }
+    }
+}
+
+/** Struct representing the buffers a program is run with, every thread evaluating cells needs its own */
+struct CEvalContext {
+    /** Value stack used for running the compiled programs */
+    CSlotStack m_stack;
+    /** Buffer the numbers of the aggregated ranges are gathered into */
+    std::vector<double> m_numbers;
+    /** Work stack of the cells waiting for their dependencies, with a flag telling if these were already pushed */
+    std::vector<std::pair<const CCell *, bool>> m_work;
+};
+
+/** Class representing a shared mutex which keeps the object holding it copyable, a copy gets its own unlocked mutex */
+class CCopyableMutex : public std::shared_mutex {
+
+public:
+    CCopyableMutex() = default;
+
+    CCopyableMutex(const CCopyableMutex &other);
+
+    CCopyableMutex &operator=(const CCopyableMutex &other);
+
+};
+
+inline CCopyableMutex::CCopyableMutex(const CCopyableMutex &other) : std::shared_mutex() {}
+
+inline CCopyableMutex &CCopyableMutex::operator=(const CCopyableMutex &other) {
+    return *this;
+}
+
+/** Class representing a pool of threads running the same job, the calling thread takes part in it as well */
+class CWorkerPool {
+
+public:
+    /** Constructor starting the threads
+     * @param[in] threads - number of the threads, including the calling one
+    */
+    CWorkerPool(size_t threads);
+
+    CWorkerPool(const CWorkerPool &other) = delete;
+
+    CWorkerPool &operator=(const CWorkerPool &other) = delete;
+
+    ~CWorkerPool();
+
+    /** Method for running a job on all threads and waiting until all of them finish it
+     * @param[in] job - function called with the index of the thread, the calling thread has index 0
+    */
+    void run(const std::function<void(size_t)> &job);
+
+private:
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    const std::function<void(size_t)> *m_job = nullptr;
+    /** Number of the jobs started so far, a thread waits until it changes */
+    size_t m_generation = 0;
+    size_t m_running = 0;
+    bool m_stop = false;
+
+    /** Method run by a thread of the pool
+     * @param[in] index - index of the thread
+    */
+    void work(size_t index);
+};
+
+inline CWorkerPool::CWorkerPool(size_t threads) {
+    for (size_t i = 1; i < threads; i++) {
+        m_threads.emplace_back(&CWorkerPool::work, this, i);
+    }
+}
+
+inline CWorkerPool::~CWorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_start.notify_all();
+    for (std::thread &thread: m_threads) {
+        thread.join();
+    }
+}
+
+inline void CWorkerPool::run(const std::function<void(size_t)> &job) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_job = &job;
+        m_running = m_threads.size();
+        m_generation++;
+    }
+    m_start.notify_all();
+
+    job(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_running == 0; });
+}
+
+inline void CWorkerPool::work(size_t index) {
+    size_t seen = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_start.wait(lock, [this, seen] { return m_stop || m_generation != seen; });
+        if (m_stop) {
+            return;
+        }
+        seen = m_generation;
+
+        const std::function<void(size_t)> &job = *m_job;
+        lock.unlock();
+        job(index);
+        lock.lock();
+
+        if (--m_running == 0) {
+            m_done.notify_one();
+        }
+    }
+}
+
+/** Derived class from CExprBuilder representing my expression builder */
+class CMyExprBuilder : public CExprBuilder {
+public:
+
+    CMyExprBuilder() = default;
+
+    CMyExprBuilder(const CMyExprBuilder &other);
+
+    CMyExprBuilder &operator=(const CMyExprBuilder &other);
+
+    /** Method for creating an addition node */
+    void opAdd() override;
+
+    /** Method for creating a subtraction node */
+    void opSub() override;
+
+    /** Method for creating a multiplication node */
+    void opMul() override;
+
+    /** Method for creating a division node */
+    void opDiv() override;
+
+    /** Method for creating a power node */
+    void opPow() override;
+
+    /** Method for creating a negation node */
+    void opNeg() override;
+
+    /** Method for creating an equality node */
+    void opEq() override;
+
+    /** Method for creating a non-equality node */
+    void opNe() override;
+
+    /** Method for creating a less than node */
+    void opLt() override;
+
+    /** Method for creating a less than or equal node */
+    void opLe() override;
+
+    /** Method for creating a greater than node */
+    void opGt() override;
+
+    /** Method for creating a greater than or equal node */
+    void opGe() override;
+
+    /** Method creating CValueNode with a number
+     * @param[in] val - number to be stored in the node
+    */
+    void valNumber(double val) override;
+
+    /** Method creating CValueNode with a string
+     * @param[in] val - string to be stored in the node
+    */
+    void valString(std::string val) override;
+
+    /** Method creating CRefNode with a reference to another cell
+     * @param[in] val - reference to be stored in the node
+    */
+    void valReference(std::string val) override;
+
+    /** Method creating CRangeNode with a range of cells
+     * @param[in] val - range to be stored in the node
+    */
+    void valRange(std::string val) override;
+
+    /** Method for creating a function call node
+     * @param[in] fnName - name of the function
+     * @param[in] paramCount - number of the arguments
+    */
+    void funcCall(std::string fnName, int paramCount) override;
+
+    /** Method creating CRefNode without going through the text of the reference
+     * @param[in] pos - referenced position
+    */
+    void addReference(const CPos &pos);
+
+    /** Method creating CRangeNode without going through the text of the range
+     * @param[in] from - position of the first corner of the range
+     * @param[in] to - position of the second corner of the range
+    */
+    void addRange(const CPos &from, const CPos &to);
+
+    /** Method for creating a function call node, the name is looked up without being copied
+     * @param[in] fnName - name of the function
+     * @param[in] paramCount - number of the arguments
+    */
+    void addFunction(std::string_view fnName, int paramCount);
+
+    /** Method for getting the value of a cell
+     * @param[in] pos - position of the cell
+     * @return value of the cell
+    */
+    CValue getVal(const CPos &pos) const;
+
+
+    /** Method for dropping the nodes left behind by a formula that failed to parse */
+    void clearStack();
+
+    /** Method for taking the formula built by the calls so far
+     * @return root node of the formula
+    */
+    ANode popNode();
+
+    /** Method for storing a shared formula into a cell
+     * @param[in] pos - position of the cell
+     * @param[in] node - root node of the formula
+     * @param[in] program - program compiled from the node
+     * @param[in] offset - offset added to the relative positions of the formula
+    */
+    void addTemplate(const CPos &pos, const ANode &node, const std::shared_ptr<const CProgram> &program,
+                     const std::pair<int, int> &offset);
+
+    /** Static method for compiling a node
+     * @param[in] node - root node of the formula
+     * @return program compiled from the node
+    */
+    static std::shared_ptr<const CProgram> compile(const ANode &node);
+
+    /** Method for checking if a node exists
+     * @param[in] pos - position of the cell
+     * @return true if the node exists, false otherwise
+    */
+    bool nodeExists(const CPos &pos) const;
+
+    /** Method for getting the number of the interned texts held by some cell
+     * @return number of the distinct texts of the cells
+    */
+    size_t textCount() const;
+
+    /** Method for adding a CValueNode to the map
+     * @param[in] pos - position of the cell
+     * @param[in] val - value of the cell
+    */
+    void addCValNode(const CPos &pos, const CValue &val);
+
+    /** Method for creating a CValueNode not stored in any cell yet
+     * @param[in] val - value of the node
+     * @return the created node
+    */
+    ANode makeValueNode(const CValue &val) const;
+
+    /** Method for copying a rectangle of cells, the copies share the formulas of the source cells
+     * @param[in] dst - position of the top-left corner of the destination rectangle
+     * @param[in] src - position of the top-left corner of the source rectangle
+     * @param[in] w - width of the rectangle
+     * @param[in] h - height of the rectangle
+     * @return positions of the written cells
+    */
+    std::vector<CPos> copyCells(const CPos &dst, const CPos &src, int w, int h);
+
+    /** Method for getting the nodes
+     * @return table of the cells
+    */
+    const CCellGrid &getNodes() const;
+
+    /** Method for recomputing the changed cells and all cells transitively depending on them
+     * @param[in] changed - positions of the changed cells
+    */
+    void recalculate(const std::vector<CPos> &changed);
+
+    /** Method for finding the reference cycles of the whole spreadsheet, the values stay dirty */
+    void detectCycles();
+
+    /** Method for finding the reference cycles among the given cells, the values stay dirty
+     * @param[in] keys - keys of the positions of the cells, the cells they depend on are not among the dirty ones
+    */
+    void detectCycles(const std::vector<uint64_t> &keys);
+
+    /** Method for evaluating all dirty cells. The cells are grouped into levels by the longest chain of dirty cells
+     * they depend on, so the cells of a level only read the values of the levels before and the levels wide enough
+     * are split among the threads.
+     * @param[in] threads - number of the threads, including the calling one
+    */
+    void recalculateAll(size_t threads);
+
+private:
+
+    APool m_pool = std::make_shared<CNodePool>();
+    std::stack<ANode> m_stack;
+    CCellGrid m_nodes;
+    /** Reverse dependency index, maps the key of a position to the keys of the cells referencing it */
+    CDependencyIndex m_dependents;
+    /** Reverse dependency index of the ranges, maps the key of a tile to the keys of the cells with a range over it */
+    CDependencyIndex m_rangeDependents;
+    /** Keys of the cells with a range over too many tiles to be indexed, they are checked for every change */
+    std::unordered_set<uint64_t> m_wideRangeDependents;
+    /** Interned text values, maps a text to the node shared by all cells holding it */
+    std::unordered_map<std::string_view, ANode> m_texts;
+    /** Number of the interned texts the unused ones are dropped at */
+    size_t m_textsLimit = MIN_TEXTS_LIMIT;
+
+    /** Minimal number of the interned texts the unused ones are dropped at */
+    static constexpr size_t MIN_TEXTS_LIMIT = 1024;
+    /** Maximal number of the tiles a range is indexed in */
+    static constexpr uint64_t MAX_RANGE_TILES = 4096;
+    static constexpr uint64_t WIDE_RANGE = UINT64_MAX;
+    /** Minimal number of the cells of a level split among the threads */
+    static constexpr size_t PARALLEL_LEVEL = 1024;
+    /** Number of the cells a thread evaluates at once */
+    static constexpr size_t PARALLEL_CHUNK = 64;
+    /** Number of the cells whose dependencies a thread gathers at once */
+    static constexpr size_t GATHER_CHUNK = 1024;
+
+    /** Static method for getting the buffers the cells are evaluated with on the calling thread, every thread reading
+     * the spreadsheet has its own
+     * @return buffers of the calling thread
+    */
+    static CEvalContext &threadContext();
+
+    /** Static method for checking if a node is a constant
+     * @param[in] node - checked node
+     * @return true if the node is a literal value, false otherwise
+    */
+    static bool isConstant(const ANode &node);
+
+    /** Method for interning the node of a value, the cells with equal text share one node and so one string, which
+     * lets the programs compare them by identity
+     * @param[in] node - CValueNode with the value of a cell
+     * @return the interned node, or the given one for a number
+    */
+    ANode internValue(ANode node);
+
+    /** Method for pushing an operator node, an operator over constants is replaced by a CValueNode with its value
+     * unless the value is empty or not finite, as such a value has no literal to be saved as
+     * @param[in] node - node of the operator
+     * @param[in] constant - whether all operands of the operator are constants
+    */
+    void pushFolded(ANode node, bool constant);
+
+    /** Method for popping the operands of a binary operator and pushing the operator node, an operation known to
+     * leave its numeric operand unchanged (x*1, 1*x, x/1, x^1, x-0) is replaced by the operand
+     * @param[in] op - operation of the node
+    */
+    template<typename TNode>
+    void pushBinary(EOp op);
+
+    /** Method for evaluating a cell, the computed value is cached until the cell is marked dirty
+     * @param[in] key - key of the position of the cell
+     * @param[in,out] context - buffers the programs are run with
+     * @return reference to the cached value of the cell, empty if the cell does not exist or is part of a cycle
+    */
+    const CValue &evalCell(uint64_t key, CEvalContext &context) const;
+
+    /** Method for evaluating an existing cell
+     * @param[in] cell - cell to be evaluated
+     * @param[in,out] context - buffers the programs are run with
+     * @return reference to the cached value of the cell, empty if the cell is part of a cycle
+    */
+    const CValue &evalCell(const CCell &cell, CEvalContext &context) const;
+
+    /** Method for running the program of a cell and storing the value
+     * @param[in] cell - cell to be evaluated
+     * @param[in,out] context - buffers the programs are run with
+     * @return reference to the cached value of the cell
+    */
+    const CValue &runCell(const CCell &cell, CEvalContext &context) const;
+
+    /** Method for pushing the dirty cells a cell depends on to the work stack
+     * @param[in] cell - cell whose references and ranges are followed
+     * @param[in,out] work - work stack of the evaluation
+    */
+    void pushDependencies(const CCell &cell, std::vector<std::pair<const CCell *, bool>> &work) const;
+
+    /** Method for evaluating the existing cells of a range
+     * @param[in] range - range of the cells
+     * @param[in] fn - function called with the value of every cell
+     * @param[in,out] context - buffers the programs are run with
+    */
+    template<typename TFn>
+    void evalRange(const CRange &range, const TFn &fn, CEvalContext &context) const;
+
+    /** Method for visiting the tiles overlapped by the ranges of a cell
+     * @param[in] key - key of the position of the cell
+     * @param[in] fn - function called with the key of the tile, or with WIDE_RANGE for a range over too many tiles
+    */
+    template<typename TFn>
+    void forEachRangeTile(uint64_t key, const TFn &fn) const;
+
+    /** Method for finding the cells with a range containing a position
+     * @param[in] key - key of the position
+     * @param[out] dependents - keys of the found cells are appended to it
+    */
+    void findRangeDependents(uint64_t key, std::vector<uint64_t> &dependents) const;
+
+    /** Method for storing a node into a cell, the cell stays dirty until it is recalculated or read
+     * @param[in] key - key of the position of the cell
+     * @param[in] node - node to be stored
+     * @param[in] program - program compiled from the node, it is compiled if nullptr, a value gets none
+     * @param[in] offset - offset added to the relative positions of the node
+    */
+    void setNode(uint64_t key, ANode node, std::shared_ptr<const CProgram> program = nullptr,
+                 const std::pair<int, int> &offset = {0, 0});
+
+    /** Method for registering the references of a cell in the reverse dependency index
+     * @param[in] key - key of the position of the cell
+    */
+    void link(uint64_t key);
+
+    /** Method for removing the references of a cell from the reverse dependency index
+     * @param[in] key - key of the position of the cell
+    */
+    void unlink(uint64_t key);
+
+    /** Method for flagging the cells in reference cycles using Tarjan's strongly connected components,
+     * only references between the given cells are followed
+     * @param[in] cells - keys of the positions of the cells
+     * @return keys of the cells outside of cycles, every cell is preceded by the cells it references
+    */
+    std::vector<uint64_t> markCycles(const std::vector<uint64_t> &cells);
+};
+
+inline CMyExprBuilder::CMyExprBuilder(const CMyExprBuilder &other)
+        : m_nodes(other.m_nodes), m_dependents(other.m_dependents), m_rangeDependents(other.m_rangeDependents),
+          m_wideRangeDependents(other.m_wideRangeDependents), m_texts(other.m_texts),
+          m_textsLimit(other.m_textsLimit) {}
+
+inline CMyExprBuilder &CMyExprBuilder::operator=(const CMyExprBuilder &other) {
+    if (this != &other) {
+        m_nodes = other.m_nodes;
+        // a fresh pool lets the old one be released in bulk once its last node is gone
+        m_pool = std::make_shared<CNodePool>();
+        // a node left on the stack by a failed parse is not part of the copied cells
+        m_stack = {};
+        m_dependents = other.m_dependents;
+        m_rangeDependents = other.m_rangeDependents;
+        m_wideRangeDependents = other.m_wideRangeDependents;
+        m_texts = other.m_texts;
+        m_textsLimit = other.m_textsLimit;
+    }
+
+    return *this;
+}
+
+inline void CMyExprBuilder::opAdd() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot add only one element");
+    }
+
+    pushBinary<opAddNode>(EOp::Add);
+}
+
+inline void CMyExprBuilder::opSub() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot subtract only one element");
+    }
+
+    pushBinary<opSubNode>(EOp::Sub);
+}
+
+inline void CMyExprBuilder::opMul() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot multiply only one element");
+    }
+
+    pushBinary<opMulNode>(EOp::Mul);
+}
+
+inline void CMyExprBuilder::opDiv() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot divide only one element");
+    }
+
+    pushBinary<opDivNode>(EOp::Div);
+}
+
+inline void CMyExprBuilder::opPow() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot power only one element");
+    }
+
+    pushBinary<opPowNode>(EOp::Pow);
+}
+
+inline void CMyExprBuilder::opNeg() {
+    if (m_stack.empty()) {
+        throw std::invalid_argument("Cannot negate only zero elements");
+    }
+
+    ANode left = std::move(m_stack.top());
+    m_stack.pop();
+    bool constant = isConstant(left);
+    pushFolded(makeNode<opNegNode>(m_pool, std::move(left)), constant);
+}
+
+inline void CMyExprBuilder::opEq() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot compare only one element");
+    }
+
+    pushBinary<opEqNode>(EOp::Eq);
+}
+
+inline void CMyExprBuilder::opNe() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot compare only one element");
+    }
+
+    pushBinary<opNeNode>(EOp::Ne);
+}
+
+inline void CMyExprBuilder::opLt() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot compare only one element");
+    }
+
+    pushBinary<opLtNode>(EOp::Lt);
+}
+
+inline void CMyExprBuilder::opLe() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot compare only one element");
+    }
+
+    pushBinary<opLeNode>(EOp::Le);
+}
+
+inline void CMyExprBuilder::opGt() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot compare only one element");
+    }
+
+    pushBinary<opGtNode>(EOp::Gt);
+}
+
+inline void CMyExprBuilder::opGe() {
+    if (m_stack.size() < 2) {
+        throw std::invalid_argument("Cannot compare only one element");
+    }
+
+    pushBinary<opGeNode>(EOp::Ge);
+}
+
+inline void CMyExprBuilder::valReference(std::string val) {
+    addReference(CPos(val));
+}
+
+inline void CMyExprBuilder::addReference(const CPos &pos) {
+    m_stack.emplace(makeNode<CRefNode>(m_pool, pos));
+}
+
+inline void CMyExprBuilder::valNumber(double val) {
+    m_stack.emplace(makeNode<CValueNode>(m_pool, CValue(val), true));
+}
+
+inline void CMyExprBuilder::valString(std::string val) {
+    m_stack.emplace(makeNode<CValueNode>(m_pool, CValue(std::move(val)), true));
+}
+
+inline void CMyExprBuilder::valRange(std::string val) {
+    size_t colon = val.find(':');
+    if (colon == std::string::npos) {
+        throw std::invalid_argument("Invalid range");
+    }
+
+    std::string_view str = val;
+    addRange(CPos(str.substr(0, colon)), CPos(str.substr(colon + 1)));
+}
+
+inline void CMyExprBuilder::addRange(const CPos &from, const CPos &to) {
+    m_stack.emplace(makeNode<CRangeNode>(m_pool, from, to));
+}
+
+inline void CMyExprBuilder::funcCall(std::string fnName, int paramCount) {
+    addFunction(fnName, paramCount);
+}
+
+inline void CMyExprBuilder::addFunction(std::string_view fnName, int paramCount) {
+    static const std::map<std::string, std::pair<EOp, int>, std::less<>> functions = {
+            {"sum",      {EOp::Sum,      1}},
+            {"count",    {EOp::Count,    1}},
+            {"min",      {EOp::Min,      1}},
+            {"max",      {EOp::Max,      1}},
+            {"avg",      {EOp::Avg,      1}},
+            {"countval", {EOp::CountVal, 2}},
+            {"if",       {EOp::If,       3}}
+    };
+
+    auto it = functions.find(fnName);
+    if (it == functions.end() || it->second.second != paramCount || int(m_stack.size()) < paramCount) {
+        throw std::invalid_argument("Invalid function call");
+    }
+
+    std::vector<ANode> args(paramCount);
+    for (int i = paramCount - 1; i >= 0; i--) {
+        args[i] = std::move(m_stack.top());
+        m_stack.pop();
+    }
+
+    if (it->second.first != EOp::If && !dynamic_cast<const CRangeNode *>(args.back().get())) {
+        throw std::invalid_argument("Function expects a range");
+    }
+
+    if (it->second.first == EOp::If) {
+        // a condition known in advance selects its branch, the other one is never evaluated
+        if (isConstant(args[0]) && args[0]->isNumeric()) {
+            double cond = std::get<double>(static_cast<const CValueNode &>(*args[0]).getVal());
+            m_stack.push(std::move(args[cond != 0 ? 1 : 2]));
+            return;
+        }
+    }
+
+    bool constant = std::all_of(args.begin(), args.end(), isConstant);
+    pushFolded(makeNode<CFuncNode>(m_pool, it->second.first, it->first, std::move(args)), constant);
+}
+
+
+inline CValue CMyExprBuilder::getVal(const CPos &pos) const {
+    return evalCell(pos.getKey(), threadContext());
+}
+
+inline CEvalContext &CMyExprBuilder::threadContext() {
+    thread_local CEvalContext context;
+    return context;
+}
+
+inline const CValue &CMyExprBuilder::evalCell(uint64_t key, CEvalContext &context) const {
+    static const CValue empty;
+    const CCell *cell = m_nodes.find(key);
+
+    return cell ? evalCell(*cell, context) : empty;
+}
+
+inline const CValue &CMyExprBuilder::evalCell(const CCell &cell, CEvalContext &context) const {
+    static const CValue empty;
+    if (!cell.m_program) {
+        return static_cast<const CValueNode &>(*cell.m_node).getVal();
+    }
+    if (cell.m_cyclic) {
+        return empty;
+    }
+
+    // the cell may be evaluated by several readers or by a copy of the spreadsheet sharing the tile, they all compute
+    // the same value
+    if (!cell.isDirty()) {
+        return cell.m_value;
+    }
+
+    // the dirty cells the cell depends on are evaluated first from an explicit work stack, a program then only reads
+    // clean values, so a reference chain of any length does not recurse on the native stack
+    std::vector<std::pair<const CCell *, bool>> &work = context.m_work;
+    size_t base = work.size();
+    work.emplace_back(&cell, false);
+    while (work.size() > base) {
+        auto [current, expanded] = work.back();
+        if (!current->isDirty()) {
+            work.pop_back();
+        } else if (!expanded) {
+            work.back().second = true;
+            pushDependencies(*current, work);
+        } else {
+            work.pop_back();
+            runCell(*current, context);
+        }
+    }
+
+    return cell.m_value;
+}
+
+inline const CValue &CMyExprBuilder::runCell(const CCell &cell, CEvalContext &context) const {
+    return cell.publish(cell.m_program->run(cell.m_offset,
+                                            [this, &context](uint64_t ref) -> const CValue & {
+                                                return evalCell(ref, context);
+                                            },
+                                            [this, &context](const CRange &range, const auto &fn) {
+                                                evalRange(range, fn, context);
+                                            },
+                                            context.m_stack, context.m_numbers));
+}
+
+inline void CMyExprBuilder::pushDependencies(const CCell &cell,
+                                             std::vector<std::pair<const CCell *, bool>> &work) const {
+    // a cycle is marked before its cells are evaluated, so a dirty cell is never reached again from its dependencies
+    auto push = [&work](const CCell &dependency) {
+        if (dependency.isDirty() && !dependency.m_cyclic) {
+            work.emplace_back(&dependency, false);
+        }
+    };
+
+    for (uint64_t ref: cell.m_refs) {
+        if (const CCell *dependency = m_nodes.find(ref)) {
+            push(*dependency);
+        }
+    }
+    for (const CRange &range: cell.m_ranges) {
+        m_nodes.forEachInRange(range, [&push](uint64_t key, const CCell &dependency) { push(dependency); });
+    }
+}
+
+template<typename TFn>
+void CMyExprBuilder::evalRange(const CRange &range, const TFn &fn, CEvalContext &context) const {
+    m_nodes.forEachInRange(range, [this, &fn, &context](uint64_t key, const CCell &cell) {
+        fn(evalCell(cell, context));
+    });
+}
+
+template<typename TFn>
+void CMyExprBuilder::forEachRangeTile(uint64_t key, const TFn &fn) const {
+    for (const CRange &range: m_nodes.find(key)->m_ranges) {
+        uint64_t from = CCellGrid::tileOf(range.m_from), to = CCellGrid::tileOf(range.m_to);
+        if (((to >> 32) - (from >> 32) + 1) * ((to & UINT32_MAX) - (from & UINT32_MAX) + 1) > MAX_RANGE_TILES) {
+            fn(WIDE_RANGE);
+            continue;
+        }
+
+        for (uint64_t col = from >> 32; col <= to >> 32; col++) {
+            for (uint64_t row = from & UINT32_MAX; row <= (to & UINT32_MAX); row++) {
+                fn(col << 32 | row);
+            }
+        }
+    }
+}
+
+inline void CMyExprBuilder::findRangeDependents(uint64_t key, std::vector<uint64_t> &dependents) const {
+    auto check = [this, key, &dependents](uint64_t cell) {
+        for (const CRange &range: m_nodes.find(cell)->m_ranges) {
+            if (range.contains(key)) {
+                dependents.push_back(cell);
+                return;
+            }
+        }
+    };
+
+    if (const CDependencyIndex::CSet *cells = m_rangeDependents.find(CCellGrid::tileOf(key))) {
+        std::for_each(cells->begin(), cells->end(), check);
+    }
+    std::for_each(m_wideRangeDependents.begin(), m_wideRangeDependents.end(), check);
+}
+
+inline ANode CMyExprBuilder::popNode() {
+    if (m_stack.size() != 1) {
+        throw std::invalid_argument("Stack size is not 1 when updating nodes");
+    }
+
+    ANode node = std::move(m_stack.top());
+    m_stack.pop();
+    node->setExpr();
+
+    return node;
+}
+
+inline void CMyExprBuilder::addTemplate(const CPos &pos, const ANode &node,
+                                        const std::shared_ptr<const CProgram> &program,
+                                        const std::pair<int, int> &offset) {
+    setNode(pos.getKey(), node, program, offset);
+}
+
+inline std::shared_ptr<const CProgram> CMyExprBuilder::compile(const ANode &node) {
+    std::shared_ptr<CProgram> program = std::make_shared<CProgram>();
+    node->compile(*program);
+
+    return program;
+}
+
+inline void CMyExprBuilder::clearStack() {
+    m_stack = {};
+}
+
+inline bool CMyExprBuilder::nodeExists(const CPos &pos) const {
+    return m_nodes.find(pos.getKey()) != nullptr;
+}
+
+inline size_t CMyExprBuilder::textCount() const {
+    // a text only referenced by the table is no longer in any cell
+    return std::count_if(m_texts.begin(), m_texts.end(), [](const auto &entry) {
+        return entry.second.use_count() > 1;
+    });
+}
+
+inline void CMyExprBuilder::addCValNode(const CPos &pos, const CValue &val) {
+    setNode(pos.getKey(), makeValueNode(val));
+}
+
+inline ANode CMyExprBuilder::makeValueNode(const CValue &val) const {
+    return makeNode<CValueNode>(m_pool, val);
+}
+
+inline bool CMyExprBuilder::isConstant(const ANode &node) {
+    return dynamic_cast<const CValueNode *>(node.get()) != nullptr;
+}
+
+inline ANode CMyExprBuilder::internValue(ANode node) {
+    const CValue &val = static_cast<const CValueNode &>(*node).getVal();
+    if (val.index() != 2) {
+        return node;
+    }
+
+    // the key views the string of the node stored under it
+    auto [it, inserted] = m_texts.try_emplace(std::get<std::string>(val), node);
+    if (!inserted) {
+        return it->second;
+    }
+
+    if (m_texts.size() >= m_textsLimit) {
+        // a text only referenced by the table is no longer in any cell nor in any copy of the spreadsheet
+        std::erase_if(m_texts, [](const auto &entry) { return entry.second.use_count() == 1; });
+        m_textsLimit = std::max(MIN_TEXTS_LIMIT, 2 * m_texts.size());
+    }
+
+    return node;
+}
+
+inline void CMyExprBuilder::pushFolded(ANode node, bool constant) {
+    if (constant) {
+        // the operands are literals, so the program never loads a cell
+        static const CValue empty;
+        CEvalContext &context = threadContext();
+        CValue val = compile(node)->run({0, 0}, [](uint64_t) -> const CValue & { return empty; },
+                                        [](const CRange &, const auto &) {}, context.m_stack, context.m_numbers);
+
+        if ((val.index() == 1 && std::isfinite(std::get<double>(val))) || val.index() == 2) {
+            node = makeNode<CValueNode>(m_pool, std::move(val), true);
+        }
+    }
+
+    m_stack.push(std::move(node));
+}
+
+template<typename TNode>
+void CMyExprBuilder::pushBinary(EOp op) {
+    ANode right = std::move(m_stack.top());
+    m_stack.pop();
+    ANode left = std::move(m_stack.top());
+    m_stack.pop();
+
+    auto isNumber = [](const ANode &node, double val) {
+        if (!isConstant(node) || !node->isNumeric()) {
+            return false;
+        }
+        double num = std::get<double>(static_cast<const CValueNode &>(*node).getVal());
+        return num == val && std::signbit(num) == std::signbit(val);
+    };
+
+    bool constant = isConstant(left) && isConstant(right);
+    if (!constant) {
+        // the identities hold for a number and for empty alike, a string operand would be turned into empty
+        if (((op == EOp::Mul || op == EOp::Div || op == EOp::Pow) && isNumber(right, 1) && left->isNumeric())
+            || (op == EOp::Sub && isNumber(right, 0) && left->isNumeric())) {
+            m_stack.push(std::move(left));
+            return;
+        }
+        if (op == EOp::Mul && isNumber(left, 1) && right->isNumeric()) {
+            m_stack.push(std::move(right));
+            return;
+        }
+    }
+
+    pushFolded(makeNode<TNode>(m_pool, std::move(left), std::move(right)), constant);
+}
+
+inline std::vector<CPos> CMyExprBuilder::copyCells(const CPos &dst, const CPos &src, int w, int h) {
+    std::vector<CPos> changed;
+    if (w <= 0 || h <= 0) {
+        return changed;
+    }
+
+    // the sources are collected first, the destination may overlap them
+    std::vector<CCellEntry> sources;
+    m_nodes.forEachInRect(src, w, h, [&sources](uint64_t key, const CCell &cell) {
+        CCell source;
+        source.m_node = cell.m_node;
+        source.m_program = cell.m_program;
+        source.m_offset = cell.m_offset;
+        sources.emplace_back(key, std::move(source));
+    });
+
+    std::pair<int, int> offset = {dst.getCol() - src.getCol(), dst.getRow() - src.getRow()};
+    for (auto &[key, cell]: sources) {
+        const CPos srcPos = CPos::fromKey(key);
+        const CPos dstPos = CPos(srcPos.getCol() + offset.first, srcPos.getRow() + offset.second);
+
+        setNode(dstPos.getKey(), std::move(cell.m_node), std::move(cell.m_program),
+                {cell.m_offset.first + offset.first, cell.m_offset.second + offset.second});
+        changed.push_back(dstPos);
+    }
+
+    return changed;
+}
+
+inline const CCellGrid &CMyExprBuilder::getNodes() const {
+    return m_nodes;
+}
+
+inline void CMyExprBuilder::recalculate(const std::vector<CPos> &changed) {
+    std::unordered_set<uint64_t> affected;
+    std::vector<uint64_t> stack;
+    for (const CPos &pos: changed) {
+        stack.push_back(pos.getKey());
+    }
+
+    while (!stack.empty()) {
+        uint64_t key = stack.back();
+        stack.pop_back();
+        if (!affected.insert(key).second) {
+            continue;
+        }
+
+        if (const CDependencyIndex::CSet *cells = m_dependents.find(key)) {
+            stack.insert(stack.end(), cells->begin(), cells->end());
+        }
+        findRangeDependents(key, stack);
+    }
+
+    for (uint64_t key: affected) {
+        if (CCell *cell = m_nodes.find(key)) {
+            cell->markDirty();
+        }
+    }
+
+    for (uint64_t key: markCycles({affected.begin(), affected.end()})) {
+        evalCell(key, threadContext());
+    }
+}
+
+inline void CMyExprBuilder::detectCycles() {
+    std::vector<uint64_t> cells;
+    cells.reserve(m_nodes.size());
+    m_nodes.forEach([&cells](uint64_t key, const CCell &cell) { cells.push_back(key); });
+
+    markCycles(cells);
+}
+
+inline void CMyExprBuilder::detectCycles(const std::vector<uint64_t> &keys) {
+    markCycles(keys);
+}
+
+inline void CMyExprBuilder::recalculateAll(size_t threads) {
+    if (threads <= 1) {
+        CEvalContext &context = threadContext();
+        m_nodes.forEach([this, &context](uint64_t key, const CCell &cell) { evalCell(cell, context); });
+        return;
+    }
+
+    // the cells are numbered through their tiles, the clean and the cyclic ones are already done
+    const uint32_t unknown = UINT32_MAX, done = UINT32_MAX - 1;
+    const CKeyTable<std::pair<uint32_t, const CTile *>> numbers = m_nodes.numberCells();
+    std::vector<const CCell *> cells;
+    std::vector<uint32_t> level;
+    cells.reserve(m_nodes.size());
+    level.reserve(m_nodes.size());
+    m_nodes.forEach([&cells, &level, unknown, done](uint64_t key, const CCell &cell) {
+        cells.push_back(&cell);
+        level.push_back(cell.isDirty() && !cell.m_cyclic ? unknown : done);
+    });
+
+    // the dirty cells each dirty cell depends on, gathered by all threads chunk by chunk
+    CWorkerPool pool(threads);
+    std::vector<CEvalContext> contexts(threads);
+    const size_t chunks = (cells.size() + GATHER_CHUNK - 1) / GATHER_CHUNK;
+    std::vector<std::vector<uint32_t>> chunkDeps(chunks);
+    std::vector<uint32_t> depsEnd(cells.size());
+    std::atomic<size_t> nextChunk = 0;
+    pool.run([&](size_t thread) {
+        for (size_t chunk = nextChunk++; chunk < chunks; chunk = nextChunk++) {
+            std::vector<uint32_t> &deps = chunkDeps[chunk];
+            auto add = [&numbers, &level, &deps, unknown](uint64_t key) {
+                uint32_t number = CCellGrid::numberOf(numbers, key);
+                if (number != UINT32_MAX && level[number] == unknown) {
+                    deps.push_back(number);
+                }
+            };
+
+            for (size_t v = chunk * GATHER_CHUNK; v < std::min((chunk + 1) * GATHER_CHUNK, cells.size()); v++) {
+                if (level[v] == unknown) {
+                    std::for_each(cells[v]->m_refs.begin(), cells[v]->m_refs.end(), add);
+                    for (const CRange &range: cells[v]->m_ranges) {
+                        m_nodes.forEachInRange(range, [&add](uint64_t key, const CCell &cell) { add(key); });
+                    }
+                }
+                depsEnd[v] = uint32_t(deps.size());
+            }
+        }
+    });
+    auto depsOf = [&chunkDeps, &depsEnd](uint32_t v) {
+        const std::vector<uint32_t> &deps = chunkDeps[v / GATHER_CHUNK];
+        uint32_t from = v % GATHER_CHUNK ? depsEnd[v - 1] : 0;
+
+        return std::make_pair(deps.begin() + from, deps.begin() + depsEnd[v]);
+    };
+
+    // the level is one more than the highest level of a dependency, the dirty cells are free of cycles
+    std::vector<uint32_t> stack;
+    uint32_t levels = 0;
+    size_t dirty = 0;
+    for (uint32_t root = 0; root < cells.size(); root++) {
+        if (level[root] != unknown) {
+            continue;
+        }
+
+        stack.push_back(root);
+        while (!stack.empty()) {
+            uint32_t v = stack.back();
+            if (level[v] != unknown) {
+                stack.pop_back();
+                continue;
+            }
+
+            uint32_t highest = 0;
+            bool ready = true;
+            auto [from, to] = depsOf(v);
+            for (auto it = from; it != to; ++it) {
+                if (level[*it] == unknown) {
+                    stack.push_back(*it);
+                    ready = false;
+                } else {
+                    highest = std::max(highest, level[*it] + 1);
+                }
+            }
+            if (ready) {
+                level[v] = highest;
+                levels = std::max(levels, highest + 1);
+                dirty++;
+                stack.pop_back();
+            }
+        }
+    }
+
+    std::vector<size_t> levelStart(levels + 1, 0);
+    for (uint32_t l: level) {
+        if (l != done) {
+            levelStart[l + 1]++;
+        }
+    }
+    for (uint32_t l = 0; l < levels; l++) {
+        levelStart[l + 1] += levelStart[l];
+    }
+    std::vector<const CCell *> order(dirty);
+    std::vector<size_t> fill(levelStart.begin(), levelStart.end() - 1);
+    for (size_t i = 0; i < cells.size(); i++) {
+        if (level[i] != done) {
+            order[fill[level[i]]++] = cells[i];
+        }
+    }
+
+    // the narrow levels are evaluated by the calling thread, the pool is only woken up for the wide ones
+    for (uint32_t l = 0; l < levels; l++) {
+        size_t from = levelStart[l], to = levelStart[l + 1];
+        if (to - from < PARALLEL_LEVEL) {
+            for (size_t i = from; i < to; i++) {
+                evalCell(*order[i], threadContext());
+            }
+            continue;
+        }
+
+        std::atomic<size_t> next = from;
+        pool.run([this, &order, &contexts, &next, to](size_t thread) {
+            for (size_t chunk = next.fetch_add(PARALLEL_CHUNK); chunk < to; chunk = next.fetch_add(PARALLEL_CHUNK)) {
+                for (size_t i = chunk; i < std::min(chunk + PARALLEL_CHUNK, to); i++) {
+                    evalCell(*order[i], contexts[thread]);
+                }
+            }
+        });
+    }
+}
+
+inline void CMyExprBuilder::setNode(uint64_t key, ANode node, std::shared_ptr<const CProgram> program,
+                                    const std::pair<int, int> &offset) {
+    if (m_nodes.find(key)) {
+        unlink(key);
+    }
+
+    if (!program && node->isExpr()) {
+        program = compile(node);
+    } else if (!program) {
+        node = internValue(std::move(node));
+    }
+
+    CCell &cell = m_nodes[key];
+    cell = CCell();
+    cell.m_node = std::move(node);
+    cell.m_program = std::move(program);
+    cell.m_offset = offset;
+    link(key);
+}
+
+inline void CMyExprBuilder::link(uint64_t key) {
+    CCell &cell = *m_nodes.find(key);
+    if (!cell.m_program) {
+        return;
+    }
+
+    cell.m_refs = cell.m_program->getRefs(cell.m_offset);
+    std::sort(cell.m_refs.begin(), cell.m_refs.end());
+    cell.m_refs.erase(std::unique(cell.m_refs.begin(), cell.m_refs.end()), cell.m_refs.end());
+    cell.m_ranges = cell.m_program->getRanges(cell.m_offset);
+
+    for (uint64_t ref: cell.m_refs) {
+        m_dependents.insert(ref, key);
+    }
+    forEachRangeTile(key, [this, key](uint64_t tile) {
+        if (tile == WIDE_RANGE) {
+            m_wideRangeDependents.insert(key);
+        } else {
+            m_rangeDependents.insert(tile, key);
+        }
+    });
+    cell.markDirty();
+}
+
+inline void CMyExprBuilder::unlink(uint64_t key) {
+    for (uint64_t ref: m_nodes.find(key)->m_refs) {
+        m_dependents.erase(ref, key);
+    }
+    forEachRangeTile(key, [this, key](uint64_t tile) {
+        if (tile == WIDE_RANGE) {
+            m_wideRangeDependents.erase(key);
+        } else {
+            m_rangeDependents.erase(tile, key);
+        }
+    });
+}
+
+inline std::vector<uint64_t> CMyExprBuilder::markCycles(const std::vector<uint64_t> &cells) {
+    std::unordered_map<uint64_t, size_t> ids;
+    std::vector<CCell *> nodes;
+    std::vector<uint64_t> keys;
+    for (uint64_t key: cells) {
+        CCell *cell = m_nodes.find(key);
+        if (cell && ids.emplace(key, nodes.size()).second) {
+            nodes.push_back(cell);
+            keys.push_back(key);
+        }
+    }
+
+    // iterative Tarjan, so that long reference chains do not exhaust the native stack
+    const size_t unvisited = SIZE_MAX;
+    std::vector<size_t> index(nodes.size(), unvisited), low(nodes.size()), next(nodes.size(), 0);
+    std::vector<bool> onStack(nodes.size(), false);
+    std::vector<size_t> callStack, component;
+    std::vector<uint64_t> order;
+    size_t counter = 0;
+    // the cells of the ranges are followed after the plain references
+    std::unordered_map<size_t, std::vector<size_t>> rangeEdges;
+    const std::vector<size_t> noEdges;
+
+    for (size_t root = 0; root < nodes.size(); root++) {
+        if (index[root] != unvisited) {
+            continue;
+        }
+
+        callStack.push_back(root);
+        while (!callStack.empty()) {
+            size_t v = callStack.back();
+            if (index[v] == unvisited) {
+                index[v] = low[v] = counter++;
+                component.push_back(v);
+                onStack[v] = true;
+                for (const CRange &range: nodes[v]->m_ranges) {
+                    std::vector<size_t> &edges = rangeEdges[v];
+                    // whichever is smaller is scanned, the range or the cells taking part
+                    if (range.area() > keys.size()) {
+                        for (size_t w = 0; w < keys.size(); w++) {
+                            if (range.contains(keys[w])) {
+                                edges.push_back(w);
+                            }
+                        }
+                        continue;
+                    }
+
+                    m_nodes.forEachInRange(range, [&ids, &edges](uint64_t key, const CCell &cell) {
+                        auto it = ids.find(key);
+                        if (it != ids.end()) {
+                            edges.push_back(it->second);
+                        }
+                    });
+                }
+            }
+
+            const std::vector<uint64_t> &refs = nodes[v]->m_refs;
+            auto edgesIt = rangeEdges.find(v);
+            const std::vector<size_t> &edges = edgesIt != rangeEdges.end() ? edgesIt->second : noEdges;
+            bool descended = false;
+            while (next[v] < refs.size() + edges.size() && !descended) {
+                size_t w;
+                if (next[v] < refs.size()) {
+                    auto it = ids.find(refs[next[v]++]);
+                    if (it == ids.end()) {
+                        continue;
+                    }
+                    w = it->second;
+                } else {
+                    w = edges[next[v]++ - refs.size()];
+                }
+
+                if (index[w] == unvisited) {
+                    callStack.push_back(w);
+                    descended = true;
+                } else if (onStack[w]) {
+                    low[v] = std::min(low[v], index[w]);
+                }
+            }
+            if (descended) {
+                continue;
+            }
+
+            callStack.pop_back();
+            if (!callStack.empty()) {
+                low[callStack.back()] = std::min(low[callStack.back()], low[v]);
+            }
+            if (low[v] != index[v]) {
+                continue;
+            }
+
+            bool cyclic = component.back() != v || std::binary_search(refs.begin(), refs.end(), keys[v])
+                          || std::find(edges.begin(), edges.end(), v) != edges.end();
+            size_t w;
+            do {
+                w = component.back();
+                component.pop_back();
+                onStack[w] = false;
+                nodes[w]->m_cyclic = cyclic;
+                if (cyclic) {
+                    nodes[w]->m_value = {};
+                    nodes[w]->m_state.store(CCell::Clean, std::memory_order_relaxed);
+                } else {
+                    order.push_back(keys[w]);
+                }
+            } while (w != v);
+        }
+    }
+
+    return order;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+/** Class representing a recursive descent parser of the formulas. It accepts the same language as parseExpression and
+ * builds the same nodes, but the tokens are only views into the formula and the positions and the functions go to the
+ * builder without creating any strings. */
+class CExprParser {
+
+public:
+    /** Constructor
+     * @param[in] expr - contents of the cell, a formula starts with '='
+     * @param[in,out] builder - builder the nodes are created with
+    */
+    CExprParser(std::string_view expr, CMyExprBuilder &builder);
+
+    /** Method for parsing the contents, the builder is left with the root node on its stack
+     * @throw std::invalid_argument if the formula is not valid
+    */
+    void parse();
+
+private:
+    enum class EToken {
+        End, Number, String, Reference, Range, Function, Add, Sub, Mul, Div, Pow, Eq, Ne, Lt, Le, Gt, Ge,
+        LeftParen, RightParen, Comma
+    };
+
+    std::string_view m_expr;
+    CMyExprBuilder &m_builder;
+    size_t m_pos = 1;
+    EToken m_token = EToken::End;
+    /** Text of the current reference, range or function name */
+    std::string_view m_text;
+    /** End of the first position of the current range in m_text */
+    size_t m_colon = 0;
+    double m_number = 0;
+    /** Contents of the current string literal, the buffer is reused by the literals of the formula */
+    std::string m_string;
+
+    /** Method for reading the next token */
+    void next();
+
+    /** Method for reading a number starting at the current position */
+    void readNumber();
+
+    /** Method for reading a string literal starting at the current position */
+    void readString();
+
+    /** Method for reading a reference, a range or a function name starting at the current position */
+    void readIdentifier();
+
+    /** Method for reading the letters and the digits of a position
+     * @return true if the position has both, false otherwise
+    */
+    bool readPos();
+
+    /** Method for parsing an equality or a non-equality, the loosest binding level
+     * @return true if the result is a range, false otherwise
+    */
+    bool parseEquality();
+
+    /** Method for parsing an ordering comparison
+     * @return true if the result is a range, false otherwise
+    */
+    bool parseComparison();
+
+    /** Method for parsing an addition or a subtraction
+     * @return true if the result is a range, false otherwise
+    */
+    bool parseSum();
+
+    /** Method for parsing a multiplication or a division
+     * @return true if the result is a range, false otherwise
+    */
+    bool parseProduct();
+
+    /** Method for parsing a negation, it binds looser than a power
+     * @return true if the result is a range, false otherwise
+    */
+    bool parseUnary();
+
+    /** Method for parsing a power, its operands are never negated
+     * @return true if the result is a range, false otherwise
+    */
+    bool parsePower();
+
+    /** Method for parsing a value, a reference, a range, a function call or a parenthesized expression
+     * @return true if the result is a range, false otherwise
+    */
+    bool parseAtom();
+
+    /** Method for parsing the arguments of a function call and checking them against the function
+     * @param[in] name - name of the function
+    */
+    void parseCall(std::string_view name);
+
+    /** Static method for checking the operands of an operator
+     * @param[in] left - whether the left operand is a range
+     * @param[in] right - whether the right operand is a range
+    */
+    static void checkOperands(bool left, bool right);
+
+};
+
+inline CExprParser::CExprParser(std::string_view expr, CMyExprBuilder &builder) : m_expr(expr), m_builder(builder) {}
+
+inline void CExprParser::parse() {
+    if (m_expr.empty() || m_expr[0] != '=') {
+        m_builder.valString(std::string(m_expr));
+        return;
+    }
+
+    next();
+    if (parseEquality()) {
+        throw std::invalid_argument("Range is invalid expression result");
+    }
+    if (m_token != EToken::End) {
+        throw std::invalid_argument("Unexpected extra tokens");
+    }
+}
+
+inline void CExprParser::next() {
+    while (m_pos < m_expr.size() && std::isspace(static_cast<unsigned char>(m_expr[m_pos]))) {
+        m_pos++;
+    }
+    if (m_pos == m_expr.size()) {
+        m_token = EToken::End;
+        return;
+    }
+
+    char c = m_expr[m_pos];
+    char following = m_pos + 1 < m_expr.size() ? m_expr[m_pos + 1] : '\0';
+    if (std::isdigit(static_cast<unsigned char>(c))) {
+        readNumber();
+        return;
+    }
+    if (c == '"') {
+        readString();
+        return;
+    }
+    if (c == '$' || std::isalpha(static_cast<unsigned char>(c))) {
+        readIdentifier();
+        return;
+    }
+
+    static const std::array<std::pair<char, EToken>, 10> single = {{
+            {'+', EToken::Add}, {'-', EToken::Sub}, {'*', EToken::Mul}, {'/', EToken::Div}, {'^', EToken::Pow},
+            {'=', EToken::Eq}, {'(', EToken::LeftParen}, {')', EToken::RightParen}, {',', EToken::Comma},
+            {'<', EToken::Lt}
+    }};
+    m_pos++;
+    if (c == '<' && (following == '>' || following == '=')) {
+        m_token = following == '>' ? EToken::Ne : EToken::Le;
+        m_pos++;
+        return;
+    }
+    if (c == '>') {
+        m_token = following == '=' ? EToken::Ge : EToken::Gt;
+        m_pos += following == '=';
+        return;
+    }
+    for (const auto &[ch, token]: single) {
+        if (ch == c) {
+            m_token = token;
+            return;
+        }
+    }
+
+    throw std::invalid_argument("Unknown character");
+}
+
+inline void CExprParser::readNumber() {
+    auto digits = [this]() {
+        size_t start = m_pos;
+        while (m_pos < m_expr.size() && std::isdigit(static_cast<unsigned char>(m_expr[m_pos]))) {
+            m_pos++;
+        }
+        return m_pos > start;
+    };
+
+    size_t start = m_pos;
+    digits();
+    if (m_pos < m_expr.size() && m_expr[m_pos] == '.') {
+        m_pos++;
+        digits();
+    }
+    if (m_pos < m_expr.size() && (m_expr[m_pos] == 'e' || m_expr[m_pos] == 'E')) {
+        m_pos++;
+        if (m_pos < m_expr.size() && (m_expr[m_pos] == '+' || m_expr[m_pos] == '-')) {
+            m_pos++;
+        }
+        if (!digits()) {
+            throw std::invalid_argument("Invalid number");
+        }
+    }
+
+    const char *first = m_expr.data() + start, *last = m_expr.data() + m_pos;
+    std::from_chars_result result = std::from_chars(first, last, m_number);
+    if (result.ec == std::errc::result_out_of_range) {
+        // the rare overflowing or underflowing literal gets the infinity or the zero strtod rounds it to
+        m_number = std::strtod(std::string(first, last).c_str(), nullptr);
+    } else if (result.ec != std::errc() || result.ptr != last) {
+        throw std::invalid_argument("Invalid number");
+    }
+    m_token = EToken::Number;
+}
+
+inline void CExprParser::readString() {
+    m_string.clear();
+    for (m_pos++; m_pos < m_expr.size(); m_pos++) {
+        if (m_expr[m_pos] != '"') {
+            m_string += m_expr[m_pos];
+        } else if (m_pos + 1 < m_expr.size() && m_expr[m_pos + 1] == '"') {
+            m_string += '"';
+            m_pos++;
+        } else {
+            m_pos++;
+            m_token = EToken::String;
+            return;
+        }
+    }
+
+    throw std::invalid_argument("Missing string terminator");
+}
+
+inline void CExprParser::readIdentifier() {
+    size_t start = m_pos;
+    if (!readPos()) {
+        // a name of a function is made of letters only and followed by its arguments
+        std::string_view name = m_expr.substr(start, m_pos - start);
+        if (name.find('$') != std::string_view::npos) {
+            throw std::invalid_argument("Invalid cell or range");
+        }
+        size_t paren = m_pos;
+        while (paren < m_expr.size() && std::isspace(static_cast<unsigned char>(m_expr[paren]))) {
+            paren++;
+        }
+        if (paren == m_expr.size() || m_expr[paren] != '(') {
+            throw std::invalid_argument("Invalid cell or range");
+        }
+        m_text = name;
+        m_token = EToken::Function;
+        return;
+    }
+
+    m_token = EToken::Reference;
+    if (m_pos < m_expr.size() && m_expr[m_pos] == ':') {
+        m_colon = m_pos - start;
+        m_pos++;
+        if (!readPos()) {
+            throw std::invalid_argument("Invalid range");
+        }
+        m_token = EToken::Range;
+    }
+    m_text = m_expr.substr(start, m_pos - start);
+}
+
+inline bool CExprParser::readPos() {
+    auto skip = [this](bool letters) {
+        size_t start = m_pos;
+        while (m_pos < m_expr.size() && (letters ? std::isalpha(static_cast<unsigned char>(m_expr[m_pos]))
+                                                 : std::isdigit(static_cast<unsigned char>(m_expr[m_pos])))) {
+            m_pos++;
+        }
+        return m_pos > start;
+    };
+
+    m_pos += m_pos < m_expr.size() && m_expr[m_pos] == '$';
+    if (!skip(true)) {
+        throw std::invalid_argument("Missing column");
+    }
+    bool absRow = m_pos < m_expr.size() && m_expr[m_pos] == '$';
+    m_pos += absRow;
+    if (skip(false)) {
+        return true;
+    }
+    if (absRow) {
+        throw std::invalid_argument("Missing row");
+    }
+
+    return false;
+}
+
+inline bool CExprParser::parseEquality() {
+    bool range = parseComparison();
+    while (m_token == EToken::Eq || m_token == EToken::Ne) {
+        EToken op = m_token;
+        next();
+        checkOperands(range, parseComparison());
+        op == EToken::Eq ? m_builder.opEq() : m_builder.opNe();
+        range = false;
+    }
+
+    return range;
+}
+
+inline bool CExprParser::parseComparison() {
+    bool range = parseSum();
+    while (m_token >= EToken::Lt && m_token <= EToken::Ge) {
+        EToken op = m_token;
+        next();
+        checkOperands(range, parseSum());
+        switch (op) {
+            case EToken::Lt:
+                m_builder.opLt();
+                break;
+            case EToken::Le:
+                m_builder.opLe();
+                break;
+            case EToken::Gt:
+                m_builder.opGt();
+                break;
+            default:
+                m_builder.opGe();
+                break;
+        }
+        range = false;
+    }
+
+    return range;
+}
+
+inline bool CExprParser::parseSum() {
+    bool range = parseProduct();
+    while (m_token == EToken::Add || m_token == EToken::Sub) {
+        EToken op = m_token;
+        next();
+        checkOperands(range, parseProduct());
+        op == EToken::Add ? m_builder.opAdd() : m_builder.opSub();
+        range = false;
+    }
+
+    return range;
+}
+
+inline bool CExprParser::parseProduct() {
+    bool range = parseUnary();
+    while (m_token == EToken::Mul || m_token == EToken::Div) {
+        EToken op = m_token;
+        next();
+        checkOperands(range, parseUnary());
+        op == EToken::Mul ? m_builder.opMul() : m_builder.opDiv();
+        range = false;
+    }
+
+    return range;
+}
+
+inline bool CExprParser::parseUnary() {
+    if (m_token != EToken::Sub) {
+        return parsePower();
+    }
+
+    next();
+    checkOperands(parseUnary(), false);
+    m_builder.opNeg();
+    return false;
+}
+
+inline bool CExprParser::parsePower() {
+    bool range = parseAtom();
+    while (m_token == EToken::Pow) {
+        next();
+        checkOperands(range, parseAtom());
+        m_builder.opPow();
+        range = false;
+    }
+
+    return range;
+}
+
+inline bool CExprParser::parseAtom() {
+    switch (m_token) {
+        case EToken::Number:
+            m_builder.valNumber(m_number);
+            next();
+            return false;
+        case EToken::String:
+            m_builder.valString(m_string);
+            next();
+            return false;
+        case EToken::Reference:
+            m_builder.addReference(CPos(m_text));
+            next();
+            return false;
+        case EToken::Range:
+            m_builder.addRange(CPos(m_text.substr(0, m_colon)), CPos(m_text.substr(m_colon + 1)));
+            next();
+            return true;
+        case EToken::Function: {
+            std::string_view name = m_text;
+            next();
+            parseCall(name);
+            return false;
+        }
+        case EToken::LeftParen: {
+            next();
+            bool range = parseEquality();
+            if (m_token != EToken::RightParen) {
+                throw std::invalid_argument("Missing )");
+            }
+            next();
+            return range;
+        }
+        default:
+            throw std::invalid_argument("Unexpected token");
+    }
+}
+
+inline void CExprParser::parseCall(std::string_view name) {
+    // the current token is the opening parenthesis
+    next();
+    // the arguments that are ranges are flagged by their bits, the functions have at most three arguments
+    int count = 0;
+    uint32_t ranges = 0;
+    auto argument = [this, &count, &ranges]() {
+        if (parseEquality() && count < 32) {
+            ranges |= 1u << count;
+        }
+        count++;
+    };
+    if (m_token != EToken::RightParen) {
+        argument();
+        while (m_token == EToken::Comma) {
+            next();
+            argument();
+        }
+    }
+    if (m_token != EToken::RightParen) {
+        throw std::invalid_argument("Missing )");
+    }
+    next();
+
+    bool valid;
+    if (name == "sum" || name == "min" || name == "max" || name == "count" || name == "avg") {
+        valid = count == 1 && ranges == 0b1;
+    } else if (name == "countval") {
+        valid = count == 2 && ranges == 0b10;
+    } else if (name == "if") {
+        valid = count == 3 && ranges == 0;
+    } else {
+        throw std::invalid_argument("Unknown function");
+    }
+    if (!valid) {
+        throw std::invalid_argument("Invalid arguments of a function");
+    }
+
+    m_builder.addFunction(name, count);
+}
+
+inline void CExprParser::checkOperands(bool left, bool right) {
+    if (left || right) {
+        throw std::invalid_argument("Range is not a valid operand");
+    }
+}
+
+/** Class representing a cache of the parsed formulas. A formula is found by its text, so the same text is parsed
+ * once, and then by its text with every relative part of a reference replaced by its distance from the cell, so a
+ * formula pasted along a column or a row is parsed once and shared by all its cells with the offsets from the first
+ * one. */
+class CFormulaCache {
+
+public:
+    /** Struct representing a cached formula together with the position it was parsed for */
+    struct CEntry {
+        ANode m_node;
+        std::shared_ptr<const CProgram> m_program;
+        size_t m_col;
+        size_t m_row;
+    };
+
+    /** Method for finding a formula, the keys of a missing one are kept for the following insert
+     * @param[in] expr - text of the formula
+     * @param[in] pos - position of the cell
+     * @param[out] offset - offset the found formula is placed into the cell with
+     * @return pointer to the found formula, nullptr if it is not cached
+     * @throw std::invalid_argument if a reference of the formula is not valid
+    */
+    const CEntry *find(std::string_view expr, const CPos &pos, std::pair<int, int> &offset);
+
+    /** Method for caching the formula missed by the last find
+     * @param[in] pos - position of the cell the formula was parsed for
+     * @param[in] node - root node of the formula
+     * @param[in] program - program compiled from the node
+    */
+    void insert(const CPos &pos, const ANode &node, const std::shared_ptr<const CProgram> &program);
+
+    /** Method for adding the lookups of another cache to the statistics
+     * @param[in] other - cache whose lookups are added
+    */
+    void addStats(const CFormulaCache &other);
+
+    /** Method for getting the number of the formulas found in the cache
+     * @return number of the hits
+    */
+    size_t hits() const;
+
+    /** Method for getting the number of the formulas that had to be parsed
+     * @return number of the misses
+    */
+    size_t misses() const;
+
+private:
+    /** Number of the cached formulas the cache is emptied at */
+    static constexpr size_t MAX_ENTRIES = 64 * 1024;
+
+    /** Struct representing the cached formulas */
+    struct CTables {
+        /** Formulas by their text, they are placed into any cell with no offset */
+        std::unordered_map<std::string, CEntry> m_texts;
+        /** Formulas by their text relative to the cell */
+        std::unordered_map<std::string, CEntry> m_shapes;
+    };
+
+    /** Cached formulas, copies of the cache share them and a shared table is cloned before a formula is inserted */
+    std::shared_ptr<CTables> m_tables = std::make_shared<CTables>();
+    /** Keys of the last lookup, the buffers are reused by the lookups */
+    std::string m_text;
+    std::string m_key;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+
+    /** Method for building the key of a formula into m_key, the tokens are split the same way CExprParser does
+     * @param[in] expr - text of the formula
+     * @param[in] pos - position of the cell
+    */
+    void makeKey(std::string_view expr, const CPos &pos);
+
+};
+
+inline const CFormulaCache::CEntry *CFormulaCache::find(std::string_view expr, const CPos &pos,
+                                                        std::pair<int, int> &offset) {
+    m_text.assign(expr);
+    if (auto it = m_tables->m_texts.find(m_text); it != m_tables->m_texts.end()) {
+        m_hits++;
+        offset = {0, 0};
+        return &it->second;
+    }
+
+    makeKey(expr, pos);
+    const auto &shapes = m_tables->m_shapes;
+    auto it = shapes.find(m_key);
+    int64_t dc = int64_t(pos.getCol()) - int64_t(it == shapes.end() ? 0 : it->second.m_col);
+    int64_t dr = int64_t(pos.getRow()) - int64_t(it == shapes.end() ? 0 : it->second.m_row);
+    if (it == shapes.end() || dc < INT_MIN || dc > INT_MAX || dr < INT_MIN || dr > INT_MAX) {
+        m_misses++;
+        return nullptr;
+    }
+
+    m_hits++;
+    offset = {int(dc), int(dr)};
+    return &it->second;
+}
+
+inline void CFormulaCache::insert(const CPos &pos, const ANode &node, const std::shared_ptr<const CProgram> &program) {
+    if (m_tables->m_shapes.size() >= MAX_ENTRIES) {
+        m_tables = std::make_shared<CTables>();
+    } else if (m_tables.use_count() > 1) {
+        m_tables = std::make_shared<CTables>(*m_tables);
+    }
+
+    CEntry entry{node, program, pos.getCol(), pos.getRow()};
+    m_tables->m_texts.emplace(m_text, entry);
+    m_tables->m_shapes.emplace(m_key, std::move(entry));
+}
+
+inline void CFormulaCache::addStats(const CFormulaCache &other) {
+    m_hits += other.m_hits;
+    m_misses += other.m_misses;
+}
+
+inline size_t CFormulaCache::hits() const {
+    return m_hits;
+}
+
+inline size_t CFormulaCache::misses() const {
+    return m_misses;
+}
+
+inline void CFormulaCache::makeKey(std::string_view expr, const CPos &pos) {
+    auto isDigit = [](char c) { return std::isdigit(static_cast<unsigned char>(c)) != 0; };
+    auto isAlpha = [](char c) { return std::isalpha(static_cast<unsigned char>(c)) != 0; };
+    auto skip = [&expr](size_t &i, const auto &fn) {
+        while (i < expr.size() && fn(expr[i])) {
+            i++;
+        }
+    };
+    // a relative part is keyed by its distance from the cell, the separators never occur outside a string literal
+    auto appendPart = [this](bool absolute, size_t value, size_t base) {
+        m_key += absolute ? '\x01' : '\x02';
+        appendNumber(m_key, absolute ? int64_t(value) : int64_t(value) - int64_t(base));
+    };
+
+    m_key.clear();
+    size_t i = 0;
+    while (i < expr.size()) {
+        size_t start = i;
+        if (expr[i] == '"') {
+            for (i++; i < expr.size(); i++) {
+                if (expr[i] == '"' && (i + 1 == expr.size() || expr[i + 1] != '"')) {
+                    break;
+                }
+                i += expr[i] == '"';
+            }
+            i = std::min(i + 1, expr.size());
+        } else if (isDigit(expr[i])) {
+            skip(i, isDigit);
+            if (i < expr.size() && expr[i] == '.') {
+                skip(++i, isDigit);
+            }
+            if (i < expr.size() && (expr[i] == 'e' || expr[i] == 'E')) {
+                i += 1 + (i + 1 < expr.size() && (expr[i + 1] == '+' || expr[i + 1] == '-'));
+                skip(i, isDigit);
+            }
+        } else if (expr[i] == '$' || isAlpha(expr[i])) {
+            bool absCol = expr[i] == '$';
+            i += absCol;
+            skip(i, isAlpha);
+            bool absRow = i < expr.size() && expr[i] == '$';
+            size_t digits = i + absRow;
+            skip(digits, isDigit);
+            if (i > start + absCol && digits > i + absRow) {
+                CPos ref(expr.substr(start, digits - start));
+                appendPart(absCol, ref.getCol(), pos.getCol());
+                appendPart(absRow, ref.getRow(), pos.getRow());
+                i = digits;
+                continue;
+            }
+        } else {
+            i++;
+        }
+        m_key.append(expr.substr(start, i - start));
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+/** Magic number starting a file in the binary format, the first byte never starts a file in the text format */
+constexpr char BINARY_MAGIC[] = "\x89" "FXL";
+/** Version 2 appends an index of the records, version 1 files are still loaded */
+constexpr uint32_t BINARY_VERSION = 2;
+
+/** Enum representing the kinds of the records of the binary format */
+enum class ERecord : uint8_t {
+    Template, Number, String, Formula
+};
+
+/** Enum representing the tokens of a formula in the binary format, one for every call of an expression builder */
+enum class EToken : uint8_t {
+    Add, Sub, Mul, Div, Pow, Neg, Eq, Ne, Lt, Le, Gt, Ge, Number, String, Reference, Range, Call
+};
+
+/** Function for computing the CRC32 checksum, eight bytes are processed at once with the slicing-by-8 tables
+ * @param[in] data - bytes to be checksummed
+ * @param[in] crc - checksum of the preceding bytes, so that the bytes can be checksummed in parts
+ * @return CRC32 of the bytes
+*/
+inline uint32_t crc32(std::string_view data, uint32_t crc = 0) {
+    static const std::array<std::array<uint32_t, 256>, 8> tables = [] {
+        std::array<std::array<uint32_t, 256>, 8> result = {};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t val = i;
+            for (int bit = 0; bit < 8; bit++) {
+                val = val & 1 ? 0xEDB88320u ^ (val >> 1) : val >> 1;
+            }
+            result[0][i] = val;
+        }
+        for (size_t k = 1; k < result.size(); k++) {
+            for (uint32_t i = 0; i < 256; i++) {
+                result[k][i] = (result[k - 1][i] >> 8) ^ result[0][result[k - 1][i] & 0xFF];
+            }
+        }
+        return result;
+    }();
+
+    const auto *bytes = reinterpret_cast<const unsigned char *>(data.data());
+    size_t i = 0;
+    crc = ~crc;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint32_t low = crc ^ (bytes[i] | bytes[i + 1] << 8 | bytes[i + 2] << 16 | uint32_t(bytes[i + 3]) << 24);
+        uint32_t high = bytes[i + 4] | bytes[i + 5] << 8 | bytes[i + 6] << 16 | uint32_t(bytes[i + 7]) << 24;
+        crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF]
+              ^ tables[4][low >> 24] ^ tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF]
+              ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+    }
+    for (; i < data.size(); i++) {
+        crc = tables[0][(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
 
-void CMyExprBuilder::opEq() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot compare only one element");
+    return ~crc;
+}
+
+/** Class representing a buffer bytes of the binary format are encoded into, numbers are little endian */
+class CByteBuffer {
+
+public:
+    void putU8(uint8_t val);
+
+    void putU32(uint32_t val);
+
+    void putU64(uint64_t val);
+
+    void putDouble(double val);
+
+    /** Method for appending a string prefixed by its length
+     * @param[in] val - string to be appended
+    */
+    void putString(std::string_view val);
+
+    /** Method for getting the encoded bytes
+     * @return encoded bytes
+    */
+    const std::string &getData() const;
+
+    /** Method for removing the encoded bytes */
+    void clear();
+
+private:
+    std::string m_data;
+};
+
+inline void CByteBuffer::putU8(uint8_t val) {
+    m_data.push_back(char(val));
+}
+
+inline void CByteBuffer::putU32(uint32_t val) {
+    for (int i = 0; i < 4; i++) {
+        m_data.push_back(char(val >> (8 * i)));
     }
+}
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opEqNode>(left, right));
+inline void CByteBuffer::putU64(uint64_t val) {
+    putU32(uint32_t(val));
+    putU32(uint32_t(val >> 32));
 }
 
-void CMyExprBuilder::opNe() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot compare only one element");
+inline void CByteBuffer::putDouble(double val) {
+    uint64_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    putU64(bits);
+}
+
+inline void CByteBuffer::putString(std::string_view val) {
+    putU32(uint32_t(val.size()));
+    m_data.append(val);
+}
+
+inline const std::string &CByteBuffer::getData() const {
+    return m_data;
+}
+
+inline void CByteBuffer::clear() {
+    m_data.clear();
+}
+
+/** Class representing a cursor over bytes of the binary format, reading past their end throws invalid_argument */
+class CByteReader {
+
+public:
+    CByteReader(std::string_view data) : m_data(data) {}
+
+    uint8_t getU8();
+
+    uint32_t getU32();
+
+    uint64_t getU64();
+
+    double getDouble();
+
+    /** Method for reading a string prefixed by its length
+     * @return view of the string in the read bytes
+    */
+    std::string_view getString();
+
+    /** Method for reading bytes
+     * @param[in] size - number of the bytes
+     * @return view of the bytes
+    */
+    std::string_view getBytes(size_t size);
+
+    /** Method for getting the bytes not read yet
+     * @return view of the remaining bytes, the cursor moves to the end
+    */
+    std::string_view getRest();
+
+    /** Method for checking if all bytes were read
+     * @return true if the cursor is at the end, false otherwise
+    */
+    bool atEnd() const;
+
+private:
+    std::string_view m_data;
+    size_t m_pos = 0;
+
+    /** Method for reading bytes
+     * @param[in] size - number of the bytes
+     * @return pointer to the bytes
+    */
+    const char *take(size_t size);
+};
+
+inline uint8_t CByteReader::getU8() {
+    return uint8_t(*take(1));
+}
+
+inline uint32_t CByteReader::getU32() {
+    const char *bytes = take(4);
+    uint32_t val = 0;
+    for (int i = 0; i < 4; i++) {
+        val |= uint32_t(uint8_t(bytes[i])) << (8 * i);
     }
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
+    return val;
+}
 
-    m_stack.push(std::make_shared<opNeNode>(left, right));
+inline uint64_t CByteReader::getU64() {
+    uint64_t low = getU32();
 
+    return low | uint64_t(getU32()) << 32;
 }
 
-void CMyExprBuilder::opLt() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot compare only one element");
+inline double CByteReader::getDouble() {
+    uint64_t bits = getU64();
+    double val;
+    std::memcpy(&val, &bits, sizeof(val));
+
+    return val;
+}
+
+inline std::string_view CByteReader::getString() {
+    return getBytes(getU32());
+}
+
+inline std::string_view CByteReader::getBytes(size_t size) {
+    return {take(size), size};
+}
+
+inline std::string_view CByteReader::getRest() {
+    std::string_view rest = m_data.substr(m_pos);
+    m_pos = m_data.size();
+
+    return rest;
+}
+
+inline bool CByteReader::atEnd() const {
+    return m_pos == m_data.size();
+}
+
+inline const char *CByteReader::take(size_t size) {
+    if (size > m_data.size() - m_pos) {
+        throw std::invalid_argument("Unexpected end of data");
     }
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opLtNode>(left, right));
+    const char *bytes = m_data.data() + m_pos;
+    m_pos += size;
+
+    return bytes;
 }
 
-void CMyExprBuilder::opLe() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot compare only one element");
+/** Derived class from CExprBuilder representing an encoder of a formula into the tokens of the binary format */
+class CFormulaEncoder : public CExprBuilder {
+
+public:
+    CFormulaEncoder(CByteBuffer &out) : m_out(out) {}
+
+    void opAdd() override { token(EToken::Add); }
+
+    void opSub() override { token(EToken::Sub); }
+
+    void opMul() override { token(EToken::Mul); }
+
+    void opDiv() override { token(EToken::Div); }
+
+    void opPow() override { token(EToken::Pow); }
+
+    void opNeg() override { token(EToken::Neg); }
+
+    void opEq() override { token(EToken::Eq); }
+
+    void opNe() override { token(EToken::Ne); }
+
+    void opLt() override { token(EToken::Lt); }
+
+    void opLe() override { token(EToken::Le); }
+
+    void opGt() override { token(EToken::Gt); }
+
+    void opGe() override { token(EToken::Ge); }
+
+    void valNumber(double val) override {
+        token(EToken::Number);
+        m_out.putDouble(val);
     }
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opLeNode>(left, right));
+    void valString(std::string val) override {
+        token(EToken::String);
+        m_out.putString(val);
+    }
+
+    void valReference(std::string val) override {
+        token(EToken::Reference);
+        m_out.putString(val);
+    }
+
+    void valRange(std::string val) override {
+        token(EToken::Range);
+        m_out.putString(val);
+    }
+
+    void funcCall(std::string fnName, int paramCount) override {
+        token(EToken::Call);
+        m_out.putString(fnName);
+        m_out.putU32(uint32_t(paramCount));
+    }
+
+private:
+    CByteBuffer &m_out;
+
+    void token(EToken tok) {
+        m_out.putU8(uint8_t(tok));
+    }
+};
+
+/** Function for replaying a formula encoded by CFormulaEncoder
+ * @param[in] data - tokens of the formula
+ * @param[out] builder - builder the calls are made on
+*/
+inline void replayExpression(std::string_view data, CExprBuilder &builder) {
+    CByteReader in(data);
+    while (!in.atEnd()) {
+        switch (EToken(in.getU8())) {
+            case EToken::Add:
+                builder.opAdd();
+                break;
+            case EToken::Sub:
+                builder.opSub();
+                break;
+            case EToken::Mul:
+                builder.opMul();
+                break;
+            case EToken::Div:
+                builder.opDiv();
+                break;
+            case EToken::Pow:
+                builder.opPow();
+                break;
+            case EToken::Neg:
+                builder.opNeg();
+                break;
+            case EToken::Eq:
+                builder.opEq();
+                break;
+            case EToken::Ne:
+                builder.opNe();
+                break;
+            case EToken::Lt:
+                builder.opLt();
+                break;
+            case EToken::Le:
+                builder.opLe();
+                break;
+            case EToken::Gt:
+                builder.opGt();
+                break;
+            case EToken::Ge:
+                builder.opGe();
+                break;
+            case EToken::Number:
+                builder.valNumber(in.getDouble());
+                break;
+            case EToken::String:
+                builder.valString(std::string(in.getString()));
+                break;
+            case EToken::Reference:
+                builder.valReference(std::string(in.getString()));
+                break;
+            case EToken::Range:
+                builder.valRange(std::string(in.getString()));
+                break;
+            case EToken::Call: {
+                std::string name(in.getString());
+                builder.funcCall(name, int(in.getU32()));
+                break;
+            }
+            default:
+                throw std::invalid_argument("Unknown token");
+        }
+    }
 }
 
-void CMyExprBuilder::opGt() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot compare only one element");
+/** Struct representing the location of a record of the binary format */
+struct CRecordLocation {
+    /** Index of the block holding the record */
+    uint32_t m_block;
+    /** Offset of the record in the payload of the block */
+    uint32_t m_pos;
+};
+
+/** Class representing a writer of the binary format, the records are prefixed by their length and grouped into blocks
+ * holding the number of the records, the size of the payload and its CRC32, an empty block ends the records. It is
+ * followed by a block with the index of the records and the offset of that block, see CMappedSheet for its layout */
+class CBlockWriter {
+
+public:
+    /** Constructor writing the header
+     * @param[out] os - output stream
+    */
+    CBlockWriter(std::ostream &os);
+
+    /** Method for starting a record
+     * @return buffer the record is encoded into
+    */
+    CByteBuffer &beginRecord();
+
+    /** Method for finishing the record encoded into the buffer returned by beginRecord
+     * @return location of the record
+    */
+    CRecordLocation endRecord();
+
+    /** Method for writing the last block and the index
+     * @param[in] templates - locations of the template records in the order of their indices
+     * @param[in] cells - keys of the positions of the cells and the locations of their records
+     * @return true if the writing was successful, false otherwise
+    */
+    bool finish(const std::vector<CRecordLocation> &templates,
+                std::vector<std::pair<uint64_t, CRecordLocation>> cells);
+
+private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    std::ostream &m_os;
+    CByteBuffer m_payload;
+    CByteBuffer m_record;
+    uint32_t m_count = 0;
+    /** Number of the bytes written so far */
+    uint64_t m_offset = 0;
+    /** Offsets of the blocks of the records */
+    std::vector<uint64_t> m_blocks;
+
+    /** Method for writing the collected records as a block */
+    void flush();
+
+    /** Method for writing a block
+     * @param[in] count - number of the records in the block
+     * @param[in] payload - payload of the block
+    */
+    void writeBlock(uint32_t count, const std::string &payload);
+
+    /** Method for writing bytes to the stream
+     * @param[in] bytes - bytes to be written
+    */
+    void write(const std::string &bytes);
+};
+
+inline CBlockWriter::CBlockWriter(std::ostream &os) : m_os(os) {
+    write(BINARY_MAGIC);
+    CByteBuffer header;
+    header.putU32(BINARY_VERSION);
+    write(header.getData());
+}
+
+inline CByteBuffer &CBlockWriter::beginRecord() {
+    m_record.clear();
+
+    return m_record;
+}
+
+inline CRecordLocation CBlockWriter::endRecord() {
+    CRecordLocation location = {uint32_t(m_blocks.size()), uint32_t(m_payload.getData().size())};
+    m_payload.putString(m_record.getData());
+    m_count++;
+    if (m_payload.getData().size() >= BLOCK_SIZE) {
+        flush();
     }
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opGtNode>(left, right));
+    return location;
 }
 
-void CMyExprBuilder::opGe() {
-    if (m_stack.size() < 2) {
-        throw std::invalid_argument("Cannot compare only one element");
+inline bool CBlockWriter::finish(const std::vector<CRecordLocation> &templates,
+                                 std::vector<std::pair<uint64_t, CRecordLocation>> cells) {
+    if (m_count > 0) {
+        flush();
+    }
+    writeBlock(0, {});
+
+    // the index is written in parts, its size is known in advance and its checksum is computed along
+    uint64_t offset = m_offset;
+    CByteBuffer chunk;
+    chunk.putU32(uint32_t(cells.size()));
+    chunk.putU32(uint32_t(4 + 8 * m_blocks.size() + 4 + 8 * templates.size() + 16 * cells.size()));
+    write(chunk.getData());
+    chunk.clear();
+
+    uint32_t crc = 0;
+    auto emit = [this, &chunk, &crc](bool force) {
+        if (force || chunk.getData().size() >= BLOCK_SIZE) {
+            crc = crc32(chunk.getData(), crc);
+            write(chunk.getData());
+            chunk.clear();
+        }
+    };
+
+    chunk.putU32(uint32_t(m_blocks.size()));
+    for (uint64_t block: m_blocks) {
+        chunk.putU64(block);
+        emit(false);
+    }
+    chunk.putU32(uint32_t(templates.size()));
+    for (const CRecordLocation &location: templates) {
+        chunk.putU32(location.m_block);
+        chunk.putU32(location.m_pos);
+        emit(false);
     }
+    std::sort(cells.begin(), cells.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (const auto &[key, location]: cells) {
+        chunk.putU64(key);
+        chunk.putU32(location.m_block);
+        chunk.putU32(location.m_pos);
+        emit(false);
+    }
+    emit(true);
 
-    ANode right = m_stack.top();
-    m_stack.pop();
-    ANode left = m_stack.top();
-    m_stack.pop();
-    m_stack.push(std::make_shared<opGeNode>(left, right));
+    chunk.putU32(crc);
+    chunk.putU64(offset);
+    write(chunk.getData());
+    m_os.flush();
+
+    return bool(m_os);
 }
 
-void CMyExprBuilder::valReference(std::string val) {
-    m_stack.emplace(std::make_shared<CRefNode>(CPos(val), m_nodes));
+inline void CBlockWriter::flush() {
+    m_blocks.push_back(m_offset);
+    writeBlock(m_count, m_payload.getData());
+    m_payload.clear();
+    m_count = 0;
 }
 
-void CMyExprBuilder::valNumber(double val) {
-    m_stack.emplace(std::make_shared<CValueNode>(CValue(val)));
+inline void CBlockWriter::writeBlock(uint32_t count, const std::string &payload) {
+    CByteBuffer header;
+    header.putU32(count);
+    header.putU32(uint32_t(payload.size()));
+    CByteBuffer trailer;
+    trailer.putU32(crc32(payload));
+
+    write(header.getData());
+    write(payload);
+    write(trailer.getData());
+}
+
+inline void CBlockWriter::write(const std::string &bytes) {
+    m_os.write(bytes.data(), std::streamsize(bytes.size()));
+    m_offset += bytes.size();
+}
+
+/** Class representing a reader of the binary format written by CBlockWriter, a damaged or truncated file throws
+ * invalid_argument */
+class CBlockReader {
+
+public:
+    /** Constructor reading and checking the header
+     * @param[in] is - input stream
+    */
+    CBlockReader(std::istream &is);
+
+    /** Method for reading the next record
+     * @param[out] record - view of the record, valid until the next call
+     * @return true if a record was read, false at the end of the file
+    */
+    bool next(std::string_view &record);
+
+private:
+    /** Size of the chunks a payload is read in, a damaged size does not allocate more than the stream holds */
+    static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+
+    std::istream &m_is;
+    uint32_t m_version = 0;
+    std::string m_payload;
+    CByteReader m_reader = CByteReader({});
+    uint32_t m_left = 0;
+    bool m_end = false;
+    /** Number of the bytes read so far */
+    uint64_t m_offset = 0;
+
+    /** Method for reading bytes from the stream
+     * @param[in] size - number of the bytes
+     * @param[out] out - string the bytes are appended to
+    */
+    void read(size_t size, std::string &out);
+
+    /** Method for reading the next block and checking its checksum */
+    void readBlock();
+
+    /** Method for reading a block and checking its checksum
+     * @return number of the records in the block
+    */
+    uint32_t readPayload();
+};
+
+inline CBlockReader::CBlockReader(std::istream &is) : m_is(is) {
+    std::string header;
+    read(8, header);
+    if (header.compare(0, 4, BINARY_MAGIC) != 0) {
+        throw std::invalid_argument("Invalid header");
+    }
+    m_version = CByteReader(std::string_view(header).substr(4)).getU32();
+    if (m_version < 1 || m_version > BINARY_VERSION) {
+        throw std::invalid_argument("Unsupported version");
+    }
 }
 
-void CMyExprBuilder::valString(std::string val) {
-    std::string valToSave = val;
-    doubleQuotes(valToSave);
-    m_stack.emplace(std::make_shared<CValueNode>(CValue(val), valToSave));
+inline bool CBlockReader::next(std::string_view &record) {
+    while (m_left == 0) {
+        if (m_end) {
+            return false;
+        }
+        readBlock();
+    }
+
+    record = m_reader.getString();
+    m_left--;
+    if (m_left == 0 && !m_reader.atEnd()) {
+        throw std::invalid_argument("Block size mismatch");
+    }
+
+    return true;
 }
 
+inline void CBlockReader::read(size_t size, std::string &out) {
+    while (size > 0) {
+        size_t chunk = std::min(size, CHUNK_SIZE);
+        size_t start = out.size();
+        out.resize(start + chunk);
+        if (!m_is.read(out.data() + start, std::streamsize(chunk))) {
+            throw std::invalid_argument("Unexpected end of file");
+        }
+        size -= chunk;
+        m_offset += chunk;
+    }
+}
 
-CValue CMyExprBuilder::getVal(const CPos &pos) const {
-    std::set<CPos> visited;
-    visited.emplace(pos);
+inline void CBlockReader::readBlock() {
+    m_left = readPayload();
+    m_reader = CByteReader(m_payload);
+    if (m_left > 0) {
+        return;
+    }
 
-    return m_nodes.at(pos)->evaluate(visited);
+    if (!m_payload.empty()) {
+        throw std::invalid_argument("Invalid end block");
+    }
+    if (m_version >= 2) {
+        // the index is only checked, the records are read in order
+        uint64_t offset = m_offset;
+        readPayload();
+        std::string trailer;
+        read(8, trailer);
+        if (CByteReader(trailer).getU64() != offset) {
+            throw std::invalid_argument("Invalid index offset");
+        }
+    }
+    if (m_is.peek() != std::char_traits<char>::eof()) {
+        throw std::invalid_argument("Data after the end");
+    }
+    m_end = true;
 }
 
-void CMyExprBuilder::updateNodes(const CPos &pos, const std::string &contents) {
-    if (m_stack.size() != 1) {
-        throw std::invalid_argument("Stack size is not 1 when updating nodes");
+inline uint32_t CBlockReader::readPayload() {
+    std::string header;
+    read(8, header);
+    CByteReader in(header);
+    uint32_t count = in.getU32();
+    uint32_t size = in.getU32();
+
+    m_payload.clear();
+    read(size, m_payload);
+    std::string trailer;
+    read(4, trailer);
+    if (CByteReader(trailer).getU32() != crc32(m_payload)) {
+        throw std::invalid_argument("Checksum mismatch");
+    }
+
+    return count;
+}
+
+/** Class representing a read-only mapping of a whole file, the file is unmapped with the object. Without mmap the
+ * file is read into a buffer. */
+class CFileMapping {
+
+public:
+    /** Constructor mapping a file
+     * @param[in] path - path to the file
+     * @throw std::invalid_argument if the file cannot be opened, is empty or cannot be mapped
+    */
+    CFileMapping(const std::string &path);
+
+    CFileMapping(const CFileMapping &other) = delete;
+
+    CFileMapping &operator=(const CFileMapping &other) = delete;
+
+    ~CFileMapping();
+
+    /** Method for getting the contents of the file
+     * @return view of the mapped bytes
+    */
+    std::string_view data() const;
+
+private:
+#if SPREADSHEET_MMAP
+    void *m_map = MAP_FAILED;
+    size_t m_size = 0;
+#else
+    std::string m_buffer;
+#endif
+};
+
+#if SPREADSHEET_MMAP
+inline CFileMapping::CFileMapping(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::invalid_argument("Cannot open the file");
+    }
+    struct stat info = {};
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        m_size = size_t(info.st_size);
+        m_map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (m_map == MAP_FAILED) {
+        throw std::invalid_argument("Cannot map the file");
+    }
+}
+
+inline CFileMapping::~CFileMapping() {
+    munmap(m_map, m_size);
+}
+
+inline std::string_view CFileMapping::data() const {
+    return {static_cast<const char *>(m_map), m_size};
+}
+#else
+inline CFileMapping::CFileMapping(const std::string &path) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {
+        throw std::invalid_argument("Cannot open the file");
+    }
+    m_buffer.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    if (ifs.bad() || m_buffer.empty()) {
+        throw std::invalid_argument("Cannot map the file");
+    }
+}
+
+inline CFileMapping::~CFileMapping() = default;
+
+inline std::string_view CFileMapping::data() const {
+    return m_buffer;
+}
+#endif
+
+/** Class representing a file in the binary format mapped into memory, its records are read on demand. The index block
+ * holds the number of the blocks of the records and their offsets, the number of the templates and their locations and
+ * then the keys of the cells sorted together with the locations of their records, its count is the number of the
+ * cells. The index is checked when the file is opened, the blocks of the records on their first use */
+class CMappedSheet {
+
+public:
+    /** Constructor mapping a file
+     * @param[in] path - path to the file
+    */
+    CMappedSheet(const std::string &path);
+
+    CMappedSheet(const CMappedSheet &other) = delete;
+
+    CMappedSheet &operator=(const CMappedSheet &other) = delete;
+
+    /** Method for getting the number of the cells
+     * @return number of the cells
+    */
+    size_t size() const;
+
+    /** Method for getting the number of the templates
+     * @return number of the templates
+    */
+    size_t templateCount() const;
+
+    /** Method for getting the key of the position of a cell
+     * @param[in] index - index of the cell
+     * @return key of the position
+    */
+    uint64_t getKey(size_t index) const;
+
+    /** Method for finding a cell
+     * @param[in] key - key of the position of the cell
+     * @return index of the cell, size() if it does not exist
+    */
+    size_t find(uint64_t key) const;
+
+    /** Method for calling a function for the indices of the cells lying in a range, columns without cells inside the
+     * range are skipped by a binary search
+     * @param[in] range - range of the positions
+     * @param[in] callback - function called with the index of the cell
+    */
+    template<typename F>
+    void forEachInRange(const CRange &range, F &&callback) const;
+
+    /** Method for reading the record of a cell
+     * @param[in] index - index of the cell
+     * @return view of the record
+    */
+    std::string_view getCell(size_t index) const;
+
+    /** Method for reading a template record
+     * @param[in] index - index of the template
+     * @return view of the record
+    */
+    std::string_view getTemplate(size_t index) const;
+
+private:
+    static constexpr size_t CELL_SIZE = 16;
+
+    /** Mapping of the file, a member so that it is unmapped when the constructor throws as well */
+    CFileMapping m_mapping;
+    std::string_view m_file;
+    std::vector<uint64_t> m_blocks;
+    /** Flags of the blocks whose checksum was already checked, they are atomic as the sheet is shared by the copies
+     * of a spreadsheet, which read it under their own locks */
+    std::unique_ptr<std::atomic<uint8_t>[]> m_checked;
+    std::string_view m_templates;
+    std::string_view m_cells;
+
+    /** Method for finding the first cell with a key not less than the given one
+     * @param[in] key - key of the position
+     * @return index of the cell
+    */
+    size_t lowerBound(uint64_t key) const;
+
+    /** Method for reading a record
+     * @param[in] entry - location of the record as stored in the index
+     * @return view of the record
+    */
+    std::string_view getRecord(std::string_view entry) const;
+};
+
+inline CMappedSheet::CMappedSheet(const std::string &path) : m_mapping(path), m_file(m_mapping.data()) {
+    // the header, the end block, the index block and the offset of the index block
+    if (m_file.size() < 8 + 12 + 12 + 8 || m_file.compare(0, 4, BINARY_MAGIC) != 0
+        || CByteReader(m_file.substr(4)).getU32() != BINARY_VERSION) {
+        throw std::invalid_argument("Invalid header");
+    }
+    uint64_t offset = CByteReader(m_file.substr(m_file.size() - 8)).getU64();
+    if (offset > m_file.size() - 8 - 12) {
+        throw std::invalid_argument("Invalid index offset");
+    }
+
+    CByteReader block(m_file.substr(offset, m_file.size() - 8 - offset));
+    uint64_t cells = block.getU32();
+    std::string_view payload = block.getString();
+    if (block.getU32() != crc32(payload) || !block.atEnd()) {
+        throw std::invalid_argument("Invalid index");
+    }
+
+    CByteReader index(payload);
+    m_blocks.resize(index.getU32());
+    for (uint64_t &blockOffset: m_blocks) {
+        blockOffset = index.getU64();
+    }
+    m_checked = std::make_unique<std::atomic<uint8_t>[]>(m_blocks.size());
+    m_templates = index.getBytes(size_t(index.getU32()) * 8);
+    m_cells = index.getRest();
+    if (m_cells.size() != cells * CELL_SIZE) {
+        throw std::invalid_argument("Invalid index");
     }
+}
+
+inline size_t CMappedSheet::size() const {
+    return m_cells.size() / CELL_SIZE;
+}
+
+inline size_t CMappedSheet::templateCount() const {
+    return m_templates.size() / 8;
+}
 
-    m_nodes[pos] = std::move(m_stack.top());
-    m_stack.pop();
-    m_nodes[pos]->setExpr();
+inline uint64_t CMappedSheet::getKey(size_t index) const {
+    return CByteReader(m_cells.substr(index * CELL_SIZE, 8)).getU64();
 }
 
-bool CMyExprBuilder::nodeExists(const CPos &pos) const {
-    if (m_nodes.find(pos) == m_nodes.end()) {
-        return false;
-    }
+inline size_t CMappedSheet::find(uint64_t key) const {
+    size_t index = lowerBound(key);
 
-    return true;
+    return index < size() && getKey(index) == key ? index : size();
 }
 
-void CMyExprBuilder::addCValNode(const CPos &pos, const CValue &val) {
-    m_nodes[pos] = std::make_shared<CValueNode>(val);
+template<typename F>
+void CMappedSheet::forEachInRange(const CRange &range, F &&callback) const {
+    const uint64_t rowFrom = range.m_from & UINT32_MAX, rowTo = range.m_to & UINT32_MAX, colTo = range.m_to >> 32;
 
+    size_t index = lowerBound(range.m_from);
+    while (index < size()) {
+        uint64_t key = getKey(index);
+        uint64_t col = key >> 32, row = key & UINT32_MAX;
+        if (col > colTo) {
+            break;
+        }
+        if (row < rowFrom) {
+            index = lowerBound(col << 32 | rowFrom);
+        } else if (row > rowTo) {
+            if (col == colTo) {
+                break;
+            }
+            index = lowerBound((col + 1) << 32 | rowFrom);
+        } else {
+            callback(index++);
+        }
+    }
 }
 
-void CMyExprBuilder::addNode(const CPos &dst, const ANode &tmp) {
-    m_nodes[dst] = tmp->clone(m_nodes);
+inline std::string_view CMappedSheet::getCell(size_t index) const {
+    return getRecord(m_cells.substr(index * CELL_SIZE + 8, 8));
 }
 
-void CMyExprBuilder::callUpdateRef(const CPos &pos, const std::pair<int, int> &offset) {
-    m_nodes[pos]->updateRef(offset);
+inline std::string_view CMappedSheet::getTemplate(size_t index) const {
+    return getRecord(m_templates.substr(index * 8, 8));
 }
 
-const std::map<CPos, ANode> &CMyExprBuilder::getNodes() const {
-    return m_nodes;
+inline size_t CMappedSheet::lowerBound(uint64_t key) const {
+    size_t from = 0, to = size();
+    while (from < to) {
+        size_t mid = from + (to - from) / 2;
+        if (getKey(mid) < key) {
+            from = mid + 1;
+        } else {
+            to = mid;
+        }
+    }
+
+    return from;
 }
 
-void CMyExprBuilder::doubleQuotes(std::string &str) {
-    for (size_t i = 0; i < str.size(); i++) {
-        if (str[i] == '"') {
-            str.insert(i, 1, '"');
-            i++;
+inline std::string_view CMappedSheet::getRecord(std::string_view entry) const {
+    CByteReader location(entry);
+    uint32_t block = location.getU32();
+    uint32_t pos = location.getU32();
+    if (block >= m_blocks.size() || m_blocks[block] > m_file.size()) {
+        throw std::invalid_argument("Invalid block");
+    }
+
+    CByteReader in(m_file.substr(m_blocks[block]));
+    in.getU32();
+    std::string_view payload = in.getString();
+    uint32_t crc = in.getU32();
+    // two threads may both check a block first, the result is the same
+    if (!m_checked[block].load(std::memory_order_acquire)) {
+        if (crc != crc32(payload)) {
+            throw std::invalid_argument("Checksum mismatch");
         }
+        m_checked[block].store(1, std::memory_order_release);
     }
-    str.insert(str.begin(), '"');
-    str.push_back('"');
+    if (pos > payload.size()) {
+        throw std::invalid_argument("Invalid record");
+    }
+
+    return CByteReader(payload.substr(pos)).getString();
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
-/** Class represenring an excel-like spreadsheet */
+/** Class represenring an excel-like spreadsheet. The values may be read by getValue and the const methods from several
+ * threads at once, the other methods need the spreadsheet for themselves. */
 class CSpreadsheet {
 public:
     static unsigned capabilities() {
-        return SPREADSHEET_CYCLIC_DEPS;
+        return SPREADSHEET_CYCLIC_DEPS | SPREADSHEET_FUNCTIONS | SPREADSHEET_FILE_IO | SPREADSHEET_PARSER;
     }
 
     CSpreadsheet() = default;
 
-    /** Method for loading the spreadsheet from a stream
+    /** Method for loading the spreadsheet from a stream in the binary or the text format
      * @param[out] is input stream
      * @return true if the loading was successful, false otherwise
     */
     bool load(std::istream &is);
 
-    /** Method for saving the spreadsheet to a stream
+    /** Method for loading the spreadsheet from a file in the binary format mapped into memory, a cell is built when it
+     * is first read or written, a cell with a damaged record reads as empty
+     * @param[in] path - path to the file
+     * @return true if the file and its index are valid, false otherwise
+    */
+    bool loadMapped(const std::string &path);
+
+    /** Method for saving the spreadsheet to a stream in the binary format
      * @param[out] os output stream
      * @return true if the saving was successful
     */
     bool save(std::ostream &os) const;
 
+    /** Method for saving the spreadsheet to a stream in the text format
+     * @param[out] os output stream
+     * @return true if the saving was successful
+    */
+    bool saveText(std::ostream &os) const;
+
     /** Method for setting the contents of a cell
      * @param[in] pos position of the cell
      * @param[in] contents contents of the cell
@@ -1275,13 +5167,24 @@ public:
     */
     bool setCell(CPos pos, std::string contents);
 
-    /** Method for getting the value of a cell
+    /** Method for setting the contents of several cells at once. The contents are parsed on several threads, the
+     * cells are stored in the given order and their dependents are recalculated once at the end.
+     * @param[in] cells - positions of the cells and their contents, the last one wins for a repeated position
+     * @param[in] threads - number of the threads parsing the contents, including the calling one
+     * @return true if every cell was set, false if some contents failed to parse, the other cells are set anyway
+    */
+    bool setCells(std::span<const std::pair<CPos, std::string>> cells,
+                  size_t threads = std::thread::hardware_concurrency());
+
+    /** Method for getting the value of a cell, it may be called from several threads at once. A clean value is read
+     * without locking, every thread evaluates the dirty cells with its own buffers.
      * @param[in] pos position of the cell
      * @return value of the cell
     */
     CValue getValue(CPos pos);
 
-    /** Method for copying a rectangle of cells
+    /** Method for copying a rectangle of cells, the part of it past the last column or row of the sheet is left out
+     * and nothing is copied if the rectangles are more than INT_MAX columns or rows apart
      * @param[in] dst position of the top-left corner of the destination rectangle
      * @param[in] src position of the top-left corner of the source rectangle
      * @param[in] w width of the rectangle
@@ -1289,38 +5192,411 @@ public:
     */
     void copyRect(CPos dst, CPos src, int w = 1, int h = 1);
 
+    /** Method for evaluating all cells not evaluated yet, for example after loading, on several threads. The cells of
+     * a mapped file are built first.
+     * @param[in] threads - number of the threads, including the calling one
+    */
+    void recalculateAll(size_t threads = std::thread::hardware_concurrency());
+
+    /** Method for getting the statistics of the cache of the parsed formulas
+     * @return number of the formulas shared from the cache and number of the formulas parsed
+    */
+    std::pair<size_t, size_t> formulaCacheStats() const;
+
+    /** Method for getting the number of the distinct texts of the cells, the cells with equal text share one string
+     * @return number of the distinct texts
+    */
+    size_t textCount() const;
+
 private:
     CMyExprBuilder m_builder;
+    /** Formulas parsed by setCell, setCells and the text format, the copies of the spreadsheet share them */
+    CFormulaCache m_formulas;
 
-    /** Method for cloning the nodes from the source rectangle
-     * @param[in] src position of the top-left corner of the source rectangle
-     * @param[in] w width of the rectangle
-     * @param[in] h height of the rectangle
-     * @param[out] tmp map of the cloned nodes
+    /** Method for parsing the contents of a cell and storing it without recalculating its dependents
+     * @param[in] pos position of the cell
+     * @param[in] contents contents of the cell
+     * @return true if the storing was successful, false otherwise
+    */
+    bool storeCell(const CPos &pos, const std::string &contents);
+
+    /** Static method for parsing the contents of a cell, a value becomes a node as well and a formula cached for
+     * another cell is shared
+     * @param[in,out] builder - builder the nodes are created with
+     * @param[in,out] cache - cache of the parsed formulas
+     * @param[in] pos - position of the cell
+     * @param[in] contents - contents of the cell
+     * @param[out] offset - offset the formula is placed into the cell with
+     * @return root node of the contents and its program, null for a value
+     * @throw std::invalid_argument if the formula is not valid
+    */
+    static std::pair<ANode, std::shared_ptr<const CProgram>> parseContents(CMyExprBuilder &builder,
+                                                                          CFormulaCache &cache, const CPos &pos,
+                                                                          const std::string &contents,
+                                                                          std::pair<int, int> &offset);
+
+    /** Minimal number of the cells of a batch parsed on several threads */
+    static constexpr size_t PARALLEL_PARSE = 1024;
+    /** Number of the cells of a batch a thread parses at once */
+    static constexpr size_t PARSE_CHUNK = 256;
+
+    /** Size the text format is collected to before it is written to the stream */
+    static constexpr size_t TEXT_BUFFER_SIZE = 64 * 1024;
+
+    /** File the cells not built yet are read from, null if every cell is built */
+    std::shared_ptr<const CMappedSheet> m_mapped;
+    /** Flags of the cells of the mapped file not built yet, in the order of its index */
+    std::vector<bool> m_pending;
+    /** Formulas of the binary format, in the order of their indices, the ones of a mapped file are built on demand */
+    std::vector<std::pair<ANode, std::shared_ptr<const CProgram>>> m_templates;
+    /** Lock of the cells of the mapped file, the readers hold it shared and the one building cells exclusively */
+    mutable CCopyableMutex m_mappedMutex;
+
+    /** Method for loading cells in the binary format
+     * @param[out] is input stream
+    */
+    void loadBinary(std::istream &is);
+
+    /** Method for storing a record of the binary format
+     * @param[in] data - bytes of the record
     */
-    void cloneSourceNodes(const CPos &src, int w, int h, std::map<CPos, ANode> &tmp) const;
+    void storeRecord(std::string_view data);
+
+    /** Method for getting a formula of the binary format, it is built from the mapped file if it was not yet
+     * @param[in] index - index of the formula
+     * @return formula and its program
+    */
+    const std::pair<ANode, std::shared_ptr<const CProgram>> &getTemplate(uint32_t index);
+
+    /** Method for building the cells of the mapped file needed for evaluating the given cells, that is the given cells
+     * and everything they transitively reference. The built cells thus never depend on a cell not built yet.
+     * @param[in] keys - keys of the positions of the cells
+    */
+    void materialize(const std::vector<uint64_t> &keys);
+
+    /** Method for building every cell of the mapped file and releasing it */
+    void materializeAll();
+
+    /** Method for getting a copy of the spreadsheet with every cell of the mapped file built
+     * @return copy of the spreadsheet sharing the built cells
+    */
+    CSpreadsheet materialized() const;
+
+    /** Method for getting the cells of the mapped file not built yet lying in a rectangle
+     * @param[in] pos - position of the top-left corner of the rectangle
+     * @param[in] w - width of the rectangle
+     * @param[in] h - height of the rectangle
+     * @return keys of the positions of the cells
+    */
+    std::vector<uint64_t> pendingInRect(const CPos &pos, int w, int h) const;
+
+    /** Method for dropping the record of a cell of the mapped file, the cell was overwritten
+     * @param[in] key - key of the position of the cell
+    */
+    void dropPending(uint64_t key);
+
+    /** Method for loading cells in the text format
+     * @param[out] is input stream
+     * @return true if the loading was successful, false otherwise
+    */
+    bool loadText(std::istream &is);
 
 };
 
-bool CSpreadsheet::save(std::ostream &os) const {
+inline bool CSpreadsheet::save(std::ostream &os) const {
+    if (m_mapped) {
+        return materialized().save(os);
+    }
+
+    CBlockWriter writer(os);
+    std::unordered_map<const CNode *, uint32_t> templates;
+    std::vector<CRecordLocation> templateLocations;
+    std::vector<std::pair<uint64_t, CRecordLocation>> cellLocations;
+
+    cellLocations.reserve(m_builder.getNodes().size());
+
+    // the records are written straight from the cells, the writer flushes them block by block
+    m_builder.getNodes().forEach([&](uint64_t key, const CCell &cell) {
+        if (!cell.m_node->isExpr()) {
+            const CValue &val = static_cast<const CValueNode &>(*cell.m_node).getVal();
+            CByteBuffer &record = writer.beginRecord();
+            if (std::holds_alternative<double>(val)) {
+                record.putU8(uint8_t(ERecord::Number));
+                record.putU64(key);
+                record.putDouble(std::get<double>(val));
+            } else {
+                record.putU8(uint8_t(ERecord::String));
+                record.putU64(key);
+                record.putString(std::get<std::string>(val));
+            }
+            cellLocations.emplace_back(key, writer.endRecord());
+            return;
+        }
+
+        auto [it, inserted] = templates.emplace(cell.m_node.get(), uint32_t(templates.size()));
+        if (inserted) {
+            CByteBuffer &record = writer.beginRecord();
+            record.putU8(uint8_t(ERecord::Template));
+            CFormulaEncoder encoder(record);
+            cell.m_node->replay(encoder);
+            templateLocations.push_back(writer.endRecord());
+        }
+
+        CByteBuffer &record = writer.beginRecord();
+        record.putU8(uint8_t(ERecord::Formula));
+        record.putU64(key);
+        record.putU32(it->second);
+        record.putU32(uint32_t(cell.m_offset.first));
+        record.putU32(uint32_t(cell.m_offset.second));
+        cellLocations.emplace_back(key, writer.endRecord());
+    });
+
+    return writer.finish(templateLocations, std::move(cellLocations));
+}
+
+inline bool CSpreadsheet::saveText(std::ostream &os) const {
+    if (m_mapped) {
+        return materialized().saveText(os);
+    }
+
     char delim = '~';
-    std::map<CPos, ANode> nodes = m_builder.getNodes();
+    std::string buffer;
+    buffer.reserve(TEXT_BUFFER_SIZE);
+
+    m_builder.getNodes().forEach([&os, &buffer, delim](uint64_t key, const CCell &cell) {
+        CPos pos = CPos::fromKey(key);
+        appendNumber(buffer, pos.getCol());
+        buffer += ' ';
+        appendNumber(buffer, pos.getRow());
+        buffer += ' ';
+        if (cell.m_node->isExpr()) {
+            buffer += '=';
+        }
+        cell.m_node->save(buffer, cell.m_offset);
+        buffer += delim;
 
-    for (const auto &pair: nodes) {
-        os << pair.first.getCol() << " " << pair.first.getRow() << " ";
-        if (nodes.at(pair.first)->isExpr()) {
-            os << "=";
+        if (buffer.size() >= TEXT_BUFFER_SIZE) {
+            os.write(buffer.data(), std::streamsize(buffer.size()));
+            buffer.clear();
         }
-        pair.second->save(os);
-        os << delim;
+    });
+    os.write(buffer.data(), std::streamsize(buffer.size()));
+
+    return bool(os);
+}
+
+inline bool CSpreadsheet::load(std::istream &is) {
+    m_builder = CMyExprBuilder();
+    m_mapped.reset();
+    m_pending.clear();
+    m_templates.clear();
+
+    bool loaded;
+    try {
+        loaded = is.peek() == uint8_t(BINARY_MAGIC[0]) ? (loadBinary(is), true) : loadText(is);
+    } catch (std::invalid_argument &) {
+        loaded = false;
+    }
+    if (!loaded) {
+        // a damaged record may leave its nodes on the stack of the builder, nothing of the file is kept
+        m_builder = CMyExprBuilder();
+        m_templates.clear();
+        return false;
     }
+    m_builder.detectCycles();
 
     return true;
 }
 
-bool CSpreadsheet::load(std::istream &is) {
+inline bool CSpreadsheet::loadMapped(const std::string &path) {
     m_builder = CMyExprBuilder();
+    m_pending.clear();
+    m_templates.clear();
+
+    try {
+        m_mapped = std::make_shared<const CMappedSheet>(path);
+    } catch (std::invalid_argument &) {
+        m_mapped.reset();
+        return false;
+    }
+    m_pending.resize(m_mapped->size(), true);
+    m_templates.resize(m_mapped->templateCount());
+
+    return true;
+}
+
+inline void CSpreadsheet::loadBinary(std::istream &is) {
+    CBlockReader reader(is);
+
+    std::string_view data;
+    while (reader.next(data)) {
+        storeRecord(data);
+    }
+    m_templates.clear();
+}
+
+inline void CSpreadsheet::storeRecord(std::string_view data) {
+    CByteReader record(data);
+    switch (ERecord(record.getU8())) {
+        case ERecord::Template: {
+            replayExpression(record.getRest(), m_builder);
+            ANode node = m_builder.popNode();
+            m_templates.emplace_back(node, CMyExprBuilder::compile(node));
+            break;
+        }
+        case ERecord::Number: {
+            CPos pos = CPos::fromKey(record.getU64());
+            m_builder.addCValNode(pos, record.getDouble());
+            break;
+        }
+        case ERecord::String: {
+            CPos pos = CPos::fromKey(record.getU64());
+            m_builder.addCValNode(pos, std::string(record.getString()));
+            break;
+        }
+        case ERecord::Formula: {
+            CPos pos = CPos::fromKey(record.getU64());
+            uint32_t index = record.getU32();
+            int dc = int32_t(record.getU32());
+            int dr = int32_t(record.getU32());
+            const auto &[node, program] = getTemplate(index);
+            m_builder.addTemplate(pos, node, program, {dc, dr});
+            break;
+        }
+        default:
+            throw std::invalid_argument("Unknown record");
+    }
+    if (!record.atEnd()) {
+        throw std::invalid_argument("Record size mismatch");
+    }
+}
+
+inline const std::pair<ANode, std::shared_ptr<const CProgram>> &CSpreadsheet::getTemplate(uint32_t index) {
+    if (index >= m_templates.size()) {
+        throw std::invalid_argument("Unknown template");
+    }
+
+    std::pair<ANode, std::shared_ptr<const CProgram>> &formula = m_templates[index];
+    if (!formula.first) {
+        CByteReader record(m_mapped->getTemplate(index));
+        if (ERecord(record.getU8()) != ERecord::Template) {
+            throw std::invalid_argument("Unknown template");
+        }
+        replayExpression(record.getRest(), m_builder);
+        formula.first = m_builder.popNode();
+        formula.second = CMyExprBuilder::compile(formula.first);
+    }
+
+    return formula;
+}
+
+inline void CSpreadsheet::materialize(const std::vector<uint64_t> &keys) {
+    if (!m_mapped) {
+        return;
+    }
+
+    std::vector<uint64_t> stack;
+    std::vector<uint64_t> built;
+    auto follow = [this, &stack](uint64_t key) {
+        const CCell *cell = m_builder.getNodes().find(key);
+        if (!cell) {
+            return;
+        }
+        stack.insert(stack.end(), cell->m_refs.begin(), cell->m_refs.end());
+        for (const CRange &range: cell->m_ranges) {
+            m_mapped->forEachInRange(range, [this, &stack](size_t index) {
+                if (m_pending[index]) {
+                    stack.push_back(m_mapped->getKey(index));
+                }
+            });
+        }
+    };
+
+    for (uint64_t key: keys) {
+        size_t index = m_mapped->find(key);
+        if (index < m_pending.size() && m_pending[index]) {
+            stack.push_back(key);
+        } else {
+            follow(key);
+        }
+    }
+
+    while (!stack.empty()) {
+        uint64_t key = stack.back();
+        stack.pop_back();
+        size_t index = m_mapped->find(key);
+        if (index == m_pending.size() || !m_pending[index]) {
+            continue;
+        }
+
+        m_pending[index] = false;
+        try {
+            storeRecord(m_mapped->getCell(index));
+        } catch (std::invalid_argument &) {
+            m_builder.clearStack();
+            continue;
+        }
+        built.push_back(key);
+        follow(key);
+    }
 
+    // the built cells only depend on each other, so their cycles are found among them, they are evaluated on demand
+    m_builder.detectCycles(built);
+}
+
+inline void CSpreadsheet::materializeAll() {
+    std::vector<uint64_t> keys;
+    for (size_t index = 0; index < m_pending.size(); index++) {
+        if (m_pending[index]) {
+            keys.push_back(m_mapped->getKey(index));
+        }
+    }
+
+    materialize(keys);
+    m_mapped.reset();
+    m_pending.clear();
+    m_templates.clear();
+}
+
+inline CSpreadsheet CSpreadsheet::materialized() const {
+    CSpreadsheet full;
+    {
+        // another thread may be building cells of the mapped file meanwhile
+        std::shared_lock<std::shared_mutex> lock(m_mappedMutex);
+        full = *this;
+    }
+    full.materializeAll();
+    return full;
+}
+
+inline std::vector<uint64_t> CSpreadsheet::pendingInRect(const CPos &pos, int w, int h) const {
+    std::vector<uint64_t> keys;
+    if (!m_mapped || w <= 0 || h <= 0) {
+        return keys;
+    }
+
+    CRange range = {pos.getKey(), CPos(pos.getCol() + w - 1, pos.getRow() + h - 1).getKey()};
+    m_mapped->forEachInRange(range, [this, &keys](size_t index) {
+        if (m_pending[index]) {
+            keys.push_back(m_mapped->getKey(index));
+        }
+    });
+
+    return keys;
+}
+
+inline void CSpreadsheet::dropPending(uint64_t key) {
+    if (!m_mapped) {
+        return;
+    }
+
+    size_t index = m_mapped->find(key);
+    if (index < m_pending.size()) {
+        m_pending[index] = false;
+    }
+}
+
+inline bool CSpreadsheet::loadText(std::istream &is) {
     std::string line;
     while (std::getline(is, line, '~')) {
         line.append("~");
@@ -1333,75 +5609,191 @@ bool CSpreadsheet::load(std::istream &is) {
         std::getline(iss, contents, '~');
         contents = contents.substr(1);
 
-        this->setCell(CPos(col, row), contents);
+        storeCell(CPos(col, row), contents);
     }
 
     return true;
 }
 
-bool CSpreadsheet::setCell(CPos pos, std::string contents) {
-    if (contents[0] == '=') {
-        try {
-            parseExpression(contents, m_builder);
-            m_builder.updateNodes(pos, contents);
-        } catch (std::invalid_argument &) {
-            return false;
+inline bool CSpreadsheet::setCell(CPos pos, std::string contents) {
+    if (!storeCell(pos, contents)) {
+        return false;
+    }
+
+    dropPending(pos.getKey());
+    materialize({pos.getKey()});
+    m_builder.recalculate({pos});
+
+    return true;
+}
+
+inline bool CSpreadsheet::setCells(std::span<const std::pair<CPos, std::string>> cells, size_t threads) {
+    std::vector<ANode> nodes(cells.size());
+    std::vector<std::shared_ptr<const CProgram>> programs(cells.size());
+    std::vector<std::pair<int, int>> offsets(cells.size());
+    auto parse = [&cells, &nodes, &programs, &offsets](CMyExprBuilder &builder, CFormulaCache &cache, size_t from,
+                                                       size_t to) {
+        for (size_t i = from; i < to; i++) {
+            try {
+                std::tie(nodes[i], programs[i]) = parseContents(builder, cache, cells[i].first, cells[i].second,
+                                                                offsets[i]);
+            } catch (std::invalid_argument &) {
+                nodes[i] = nullptr;
+            }
         }
+    };
 
+    threads = std::max<size_t>(threads, 1);
+    if (threads == 1 || cells.size() < PARALLEL_PARSE) {
+        parse(m_builder, m_formulas, 0, cells.size());
     } else {
-        try {
-            double num = std::stod(contents);
-            m_builder.addCValNode(pos, num);
-        } catch (std::invalid_argument &) {
-            m_builder.addCValNode(pos, contents);
+        // the other threads build the nodes in their own pools, the nodes keep their pool alive, and cache the
+        // formulas of the batch for themselves
+        std::vector<CMyExprBuilder> builders(threads - 1);
+        std::vector<CFormulaCache> caches(threads - 1);
+        CWorkerPool pool(threads);
+        std::atomic<size_t> next = 0;
+        pool.run([this, &builders, &caches, &parse, &next, &cells](size_t thread) {
+            CMyExprBuilder &builder = thread ? builders[thread - 1] : m_builder;
+            CFormulaCache &cache = thread ? caches[thread - 1] : m_formulas;
+            for (size_t from = next.fetch_add(PARSE_CHUNK); from < cells.size(); from = next.fetch_add(PARSE_CHUNK)) {
+                parse(builder, cache, from, std::min(from + PARSE_CHUNK, cells.size()));
+            }
+        });
+        for (const CFormulaCache &cache: caches) {
+            m_formulas.addStats(cache);
+        }
+    }
+
+    bool all = true;
+    std::vector<CPos> changed;
+    std::vector<uint64_t> keys;
+    changed.reserve(cells.size());
+    keys.reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); i++) {
+        if (!nodes[i]) {
+            all = false;
+            continue;
         }
 
+        m_builder.addTemplate(cells[i].first, nodes[i], programs[i], offsets[i]);
+        dropPending(cells[i].first.getKey());
+        changed.push_back(cells[i].first);
+        keys.push_back(cells[i].first.getKey());
     }
 
+    materialize(keys);
+    m_builder.recalculate(changed);
+
+    return all;
+}
+
+inline bool CSpreadsheet::storeCell(const CPos &pos, const std::string &contents) {
+    std::pair<int, int> offset = {0, 0};
+    std::pair<ANode, std::shared_ptr<const CProgram>> formula;
+    try {
+        formula = parseContents(m_builder, m_formulas, pos, contents, offset);
+    } catch (std::invalid_argument &) {
+        return false;
+    }
+
+    m_builder.addTemplate(pos, formula.first, formula.second, offset);
     return true;
 }
 
-CValue CSpreadsheet::getValue(CPos pos) {
-    if (!m_builder.nodeExists(pos)) {
-        return {};
+inline std::pair<ANode, std::shared_ptr<const CProgram>> CSpreadsheet::parseContents(CMyExprBuilder &builder,
+                                                                                     CFormulaCache &cache,
+                                                                                     const CPos &pos,
+                                                                                     const std::string &contents,
+                                                                                     std::pair<int, int> &offset) {
+    offset = {0, 0};
+    if (contents[0] == '=') {
+        if (const CFormulaCache::CEntry *entry = cache.find(contents, pos, offset)) {
+            return {entry->m_node, entry->m_program};
+        }
+
+        ANode node;
+        try {
+            CExprParser(contents, builder).parse();
+            node = builder.popNode();
+        } catch (std::invalid_argument &) {
+            builder.clearStack();
+            throw;
+        }
+        std::shared_ptr<const CProgram> program = CMyExprBuilder::compile(node);
+        cache.insert(pos, node, program);
+        return {node, program};
+    }
+
+    double num;
+    if (parseNumber(contents, num)) {
+        return {builder.makeValueNode(num), nullptr};
     }
 
-    return m_builder.getVal(pos);
+    return {builder.makeValueNode(contents), nullptr};
 }
 
-void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h) {
-    std::pair<int, int> offset = {dst.getCol() - src.getCol(), dst.getRow() - src.getRow()};
-    std::map<CPos, ANode> tmp;
-    cloneSourceNodes(src, w, h, tmp);
+inline std::pair<size_t, size_t> CSpreadsheet::formulaCacheStats() const {
+    return {m_formulas.hits(), m_formulas.misses()};
+}
 
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            const CPos srcPos = CPos(src.getCol() + x, src.getRow() + y);
-            const CPos dstPos = CPos(dst.getCol() + x, dst.getRow() + y);
+inline size_t CSpreadsheet::textCount() const {
+    return m_builder.textCount();
+}
 
-            if (m_builder.nodeExists(srcPos)) {
-                m_builder.addNode(dstPos, tmp[srcPos]);
-                m_builder.callUpdateRef(dstPos, offset);
+inline CValue CSpreadsheet::getValue(CPos pos) {
+    if (m_mapped) {
+        {
+            std::shared_lock<std::shared_mutex> lock(m_mappedMutex);
+            if (pendingInRect(pos, 1, 1).empty()) {
+                return m_builder.nodeExists(pos) ? m_builder.getVal(pos) : CValue();
             }
         }
+
+        // the cells already built never depend on a cell not built yet, the pending ones are checked again under the
+        // exclusive lock as another thread may have built them meanwhile
+        std::unique_lock<std::shared_mutex> lock(m_mappedMutex);
+        materialize(pendingInRect(pos, 1, 1));
+        return m_builder.nodeExists(pos) ? m_builder.getVal(pos) : CValue();
     }
+
+    return m_builder.nodeExists(pos) ? m_builder.getVal(pos) : CValue();
 }
 
-void CSpreadsheet::cloneSourceNodes(const CPos &src, int w, int h, std::map<CPos, ANode> &tmp) const {
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            const CPos srcPos = CPos(src.getCol() + x, src.getRow() + y);
+inline void CSpreadsheet::recalculateAll(size_t threads) {
+    if (m_mapped) {
+        materializeAll();
+    }
 
-            if (m_builder.nodeExists(srcPos)) {
-                tmp[srcPos] = m_builder.getNodes().at(srcPos)->clone(m_builder.getNodes());
-            }
-        }
+    m_builder.recalculateAll(std::max<size_t>(threads, 1));
+}
+
+inline void CSpreadsheet::copyRect(CPos dst, CPos src, int w, int h) {
+    // the offsets of the copied formulas are stored as int
+    int64_t dc = int64_t(dst.getCol()) - int64_t(src.getCol()), dr = int64_t(dst.getRow()) - int64_t(src.getRow());
+    if (w <= 0 || h <= 0 || dc < INT_MIN || dc > INT_MAX || dr < INT_MIN || dr > INT_MAX) {
+        return;
+    }
+
+    // the part of the rectangle past the last column or row of the sheet is left out
+    w = int(std::min<size_t>(w, CPos::MAX_INDEX + 1 - std::max(dst.getCol(), src.getCol())));
+    h = int(std::min<size_t>(h, CPos::MAX_INDEX + 1 - std::max(dst.getRow(), src.getRow())));
+    materialize(pendingInRect(src, w, h));
+
+    std::vector<CPos> changed = m_builder.copyCells(dst, src, w, h);
+    std::vector<uint64_t> keys;
+    for (const CPos &pos: changed) {
+        dropPending(pos.getKey());
+        keys.push_back(pos.getKey());
     }
+    materialize(keys);
+    m_builder.recalculate(changed);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 
-#ifndef __PROGTEST__
+// the tests are left out when the spreadsheet is built into another program, such as the benchmark
+#if !defined(__PROGTEST__) && !defined(SPREADSHEET_NO_MAIN)
 
 bool valueMatch(const CValue &r,
                 const CValue &s) {
@@ -1603,9 +5995,552 @@ int main() {
     assert (x5.setCell(CPos("C1"), "=D1"));
     assert (x5.setCell(CPos("D1"), "=E1"));
     assert (x5.setCell(CPos("E1"), "=C1"));
+    assert (valueMatch(x5.getValue(CPos("A1")), CValue()));
+    assert (valueMatch(x5.getValue(CPos("D1")), CValue()));
+    assert (x5.setCell(CPos("E1"), "5"));
+    assert (valueMatch(x5.getValue(CPos("A1")), CValue(5.0)));
+    assert (valueMatch(x5.getValue(CPos("C1")), CValue(5.0)));
+    assert (x5.setCell(CPos("E1"), "=A1"));
+    assert (valueMatch(x5.getValue(CPos("B1")), CValue()));
+    assert (valueMatch(x5.getValue(CPos("E1")), CValue()));
+    assert (x5.setCell(CPos("F1"), "7"));
+    assert (x5.setCell(CPos("G1"), "=F1*2+0*A1"));
+    assert (x5.setCell(CPos("H1"), "=F1*2"));
+    oss.clear();
+    oss.str("");
+    assert (x5.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    CSpreadsheet x7;
+    assert (x7.load(iss));
+    assert (valueMatch(x7.getValue(CPos("C1")), CValue()));
+    assert (valueMatch(x7.getValue(CPos("G1")), CValue()));
+    assert (valueMatch(x7.getValue(CPos("H1")), CValue(14.0)));
+    assert (x7.setCell(CPos("B1"), "3"));
+    assert (valueMatch(x7.getValue(CPos("G1")), CValue(14.0)));
+    assert (valueMatch(x7.getValue(CPos("E1")), CValue(3.0)));
+
+    CSpreadsheet x6;
+    assert (x6.setCell(CPos("A1"), "1"));
+    for (size_t i = 2; i <= 2000; i++) {
+        assert (x6.setCell(CPos(1, i), "=A" + std::to_string(i - 1) + "+1"));
+    }
+    for (size_t i = 2000; i >= 1; i--) {
+        assert (valueMatch(x6.getValue(CPos(1, i)), CValue(double(i))));
+    }
+    assert (x6.setCell(CPos("A1"), "11"));
+    assert (valueMatch(x6.getValue(CPos("A2000")), CValue(2010.0)));
+    assert (valueMatch(x6.getValue(CPos("A1000")), CValue(1010.0)));
+
+    CSpreadsheet x8;
+    assert (x8.setCell(CPos("BJ62"), "2"));
+    assert (x8.setCell(CPos("BM66"), "=BJ62*3"));
+    assert (x8.setCell(CPos("ZZ1000000"), "=$BJ$62+1"));
+    x8.copyRect(CPos("DA200"), CPos("BJ62"), 8, 8);
+    assert (valueMatch(x8.getValue(CPos("DA200")), CValue(2.0)));
+    assert (valueMatch(x8.getValue(CPos("DD204")), CValue(6.0)));
+    assert (valueMatch(x8.getValue(CPos("DB201")), CValue()));
+    x8.copyRect(CPos("ZZ999999"), CPos("ZZ1000000"));
+    assert (valueMatch(x8.getValue(CPos("ZZ999999")), CValue(3.0)));
+
+    CSpreadsheet x9;
+    assert (x9.setCell(CPos("A1"), "1"));
+    assert (x9.setCell(CPos("A2"), "2.5"));
+    assert (x9.setCell(CPos("A3"), "abc"));
+    assert (x9.setCell(CPos("A5"), "=A1*4"));
+    assert (x9.setCell(CPos("B1"), "=sum(A1:A6)"));
+    assert (x9.setCell(CPos("B2"), "=count($A$1:A6)"));
+    assert (x9.setCell(CPos("B3"), "=min(A6:A1)"));
+    assert (x9.setCell(CPos("B4"), "=max(A1:A6)"));
+    assert (x9.setCell(CPos("B6"), "=countval(2.5, A1:A6)"));
+    assert (x9.setCell(CPos("B7"), "=if(B6, \"yes\", \"no\")"));
+    assert (x9.setCell(CPos("B8"), "=sum(C1:C9)"));
+    assert (valueMatch(x9.getValue(CPos("B1")), CValue(7.5)));
+    assert (valueMatch(x9.getValue(CPos("B2")), CValue(4.0)));
+    assert (valueMatch(x9.getValue(CPos("B3")), CValue(1.0)));
+    assert (valueMatch(x9.getValue(CPos("B4")), CValue(4.0)));
+    assert (valueMatch(x9.getValue(CPos("B6")), CValue(1.0)));
+    assert (valueMatch(x9.getValue(CPos("B7")), CValue("yes")));
+    assert (valueMatch(x9.getValue(CPos("B8")), CValue()));
+    assert (x9.setCell(CPos("A6"), "10"));
+    assert (x9.setCell(CPos("A2"), "3"));
+    assert (valueMatch(x9.getValue(CPos("B1")), CValue(18.0)));
+    assert (valueMatch(x9.getValue(CPos("B4")), CValue(10.0)));
+    assert (valueMatch(x9.getValue(CPos("B7")), CValue("no")));
+    assert (!x9.setCell(CPos("B9"), "=sum(A1)"));
+    assert (!x9.setCell(CPos("B9"), "=foo(A1:A2)"));
+    x9.copyRect(CPos("B11"), CPos("B1"), 1, 2);
+    assert (valueMatch(x9.getValue(CPos("B11")), CValue()));
+    assert (valueMatch(x9.getValue(CPos("B12")), CValue(5.0)));
+    assert (x9.setCell(CPos("A4"), "=B1"));
+    assert (valueMatch(x9.getValue(CPos("B1")), CValue()));
+    assert (valueMatch(x9.getValue(CPos("A4")), CValue()));
+    assert (valueMatch(x9.getValue(CPos("B4")), CValue(10.0)));
+    assert (valueMatch(x9.getValue(CPos("B2")), CValue(5.0)));
+    oss.clear();
+    oss.str("");
+    assert (x9.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    CSpreadsheet x10;
+    assert (x10.load(iss));
+    assert (valueMatch(x10.getValue(CPos("B1")), CValue()));
+    assert (x10.setCell(CPos("A4"), "-4"));
+    assert (valueMatch(x10.getValue(CPos("B1")), CValue(14.0)));
+    assert (valueMatch(x10.getValue(CPos("B3")), CValue(-4.0)));
+    assert (x10.setCell(CPos("A13"), "5"));
+    assert (valueMatch(x10.getValue(CPos("B11")), CValue(5.0)));
+
+    CSpreadsheet x11;
+    assert (x11.setCell(CPos("A1"), "2"));
+    assert (x11.setCell(CPos("B3"), "5"));
+    assert (x11.setCell(CPos("B1"), "=A1*$A$1"));
+    x11.copyRect(CPos("B2"), CPos("B1"));
+    x11.copyRect(CPos("C3"), CPos("B2"));
+    assert (valueMatch(x11.getValue(CPos("C3")), CValue(10.0)));
+    oss.clear();
+    oss.str("");
+    assert (x11.saveText(oss));
+    assert (oss.str().find("(B3*$A$1)") != std::string::npos);
+    CSpreadsheet x12(x11);
+    assert (x11.setCell(CPos("B1"), "=A1"));
+    x11.copyRect(CPos("C3"), CPos("B1"));
+    assert (valueMatch(x11.getValue(CPos("C3")), CValue(5.0)));
+    assert (valueMatch(x12.getValue(CPos("C3")), CValue(10.0)));
+    assert (valueMatch(x12.getValue(CPos("B2")), CValue()));
+    x11 = x12;
+    assert (x12.setCell(CPos("A1"), "3"));
+    assert (valueMatch(x12.getValue(CPos("C3")), CValue(15.0)));
+    assert (valueMatch(x11.getValue(CPos("C3")), CValue(10.0)));
+    assert (x11.setCell(CPos("B3"), "1"));
+    assert (valueMatch(x11.getValue(CPos("C3")), CValue(2.0)));
+    assert (valueMatch(x12.getValue(CPos("C3")), CValue(15.0)));
+
+    CSpreadsheet x13;
+    assert (x13.setCell(CPos("A1"), "1.5"));
+    assert (x13.setCell(CPos("A2"), "text ~ with 0 1 =A1 inside"));
+    assert (x13.setCell(CPos("B1"), "=$A$1*2+count($A$1:A2)"));
+    assert (x13.setCell(CPos("C1"), "=\"s~\"+A1"));
+    for (int row = 2; row < 200; row++)
+        x13.copyRect(CPos("B" + std::to_string(row)), CPos("B1"));
+    assert (x13.setCell(CPos("D1"), "=D2"));
+    assert (x13.setCell(CPos("D2"), "=D1"));
+    oss.clear();
+    oss.str("");
+    assert (x13.save(oss));
+    data = oss.str();
+    iss.clear();
+    iss.str(data);
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("A2")), CValue("text ~ with 0 1 =A1 inside")));
+    assert (valueMatch(x11.getValue(CPos("B1")), CValue(5.0)));
+    assert (valueMatch(x11.getValue(CPos("B2")), CValue(5.0)));
+    assert (valueMatch(x11.getValue(CPos("B199")), CValue(5.0)));
+    assert (valueMatch(x11.getValue(CPos("C1")), CValue("s~1.500000")));
+    assert (valueMatch(x11.getValue(CPos("D1")), CValue()));
+    assert (x11.setCell(CPos("A198"), "4"));
+    assert (valueMatch(x11.getValue(CPos("B198")), CValue(6.0)));
+    data[data.size() / 2] ^= 0x01;
+    iss.clear();
+    iss.str(data);
+    assert (!x11.load(iss));
+    iss.clear();
+    iss.str(oss.str().substr(0, oss.str().size() - 1));
+    assert (!x11.load(iss));
+    {
+        // a checksummed template of two numbers without an operator leaves no nodes behind nor any cell of the file
+        std::ostringstream damaged;
+        CBlockWriter writer(damaged);
+        CByteBuffer &number = writer.beginRecord();
+        number.putU8(uint8_t(ERecord::Number));
+        number.putU64(CPos("A2").getKey());
+        number.putDouble(3);
+        CRecordLocation numberLocation = writer.endRecord();
+        CByteBuffer &record = writer.beginRecord();
+        record.putU8(uint8_t(ERecord::Template));
+        for (int i = 0; i < 2; i++) {
+            record.putU8(uint8_t(EToken::Number));
+            record.putDouble(i);
+        }
+        CRecordLocation location = writer.endRecord();
+        assert (writer.finish({location}, {{CPos("A2").getKey(), numberLocation}}));
+        iss.clear();
+        iss.str(damaged.str());
+        assert (!x11.load(iss));
+        assert (valueMatch(x11.getValue(CPos("A2")), CValue()));
+        assert (x11.setCell(CPos("A1"), "=1+2"));
+        assert (valueMatch(x11.getValue(CPos("A1")), CValue(3.0)));
+    }
+    oss.clear();
+    oss.str("");
+    assert (x12.saveText(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("C3")), CValue(15.0)));
+    assert (x11.setCell(CPos("A1"), "0.30000000000000004"));
+    assert (x11.setCell(CPos("A2"), "=A1>=0.30000000000000004"));
+    oss.clear();
+    oss.str("");
+    assert (x11.saveText(oss));
+    assert (oss.str().find("(A1>=0.30000000000000004)") != std::string::npos);
+    iss.clear();
+    iss.str(oss.str());
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("A2")), CValue(1.0)));
+    assert (std::get<double>(x11.getValue(CPos("A1"))) == 0.30000000000000004);
+
+    const char *path = "semester_mapped.bin";
+    std::ofstream ofs(path, std::ios::binary);
+    assert (x13.save(ofs));
+    ofs.close();
+    CSpreadsheet x14;
+    assert (x14.loadMapped(path));
+    assert (valueMatch(x14.getValue(CPos("B150")), CValue(5.0)));
+    assert (valueMatch(x14.getValue(CPos("D2")), CValue()));
+    assert (valueMatch(x14.getValue(CPos("Z9")), CValue()));
+    CSpreadsheet x15(x14);
+    assert (x14.setCell(CPos("A1"), "2"));
+    assert (valueMatch(x14.getValue(CPos("B150")), CValue(6.0)));
+    assert (valueMatch(x14.getValue(CPos("B7")), CValue(6.0)));
+    assert (valueMatch(x15.getValue(CPos("B7")), CValue(5.0)));
+    assert (x14.setCell(CPos("E1"), "=sum(B1:B199)"));
+    assert (valueMatch(x14.getValue(CPos("E1")), CValue(1194.0)));
+    x15.copyRect(CPos("C2"), CPos("C1"));
+    assert (valueMatch(x15.getValue(CPos("C2")), CValue("s~text ~ with 0 1 =A1 inside")));
+    assert (x15.setCell(CPos("A2"), "=A3"));
+    assert (x15.setCell(CPos("A3"), "=A2"));
+    assert (valueMatch(x15.getValue(CPos("B1")), CValue(4.0)));
+    oss.clear();
+    oss.str("");
+    assert (x15.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("B9")), CValue(4.0)));
+    assert (valueMatch(x11.getValue(CPos("A2")), CValue()));
+    assert (valueMatch(x11.getValue(CPos("C1")), CValue("s~1.500000")));
+    assert (valueMatch(x11.getValue(CPos("C2")), CValue()));
+    data = oss.str();
+    data.pop_back();
+    ofs.open(path, std::ios::binary);
+    ofs << data;
+    ofs.close();
+    assert (!x14.loadMapped(path));
+    std::remove(path);
+    assert (!x14.loadMapped(path));
+
+    CSpreadsheet x16;
+    assert (x16.setCell(CPos("A1"), "1"));
+    assert (x16.setCell(CPos("B1"), "=A1*2"));
+    assert (x16.setCell(CPos("C1"), "=B1+$A$1"));
+    assert (x16.setCell(CPos("D1"), "=sum(A1:C1)"));
+    assert (x16.setCell(CPos("A2"), "=A1+1"));
+    for (int row = 3; row <= 4000; row++)
+        x16.copyRect(CPos("A" + std::to_string(row)), CPos("A2"));
+    assert (x16.setCell(CPos("F1"), "=$A$1*3+1"));
+    for (int rows = 1; rows < 4000; rows *= 2)
+        x16.copyRect(CPos("B" + std::to_string(rows + 1)), CPos("B1"), 5, rows);
+    assert (x16.setCell(CPos("E1"), "=sum(D1:D4000)+E2"));
+    assert (x16.setCell(CPos("E2"), "=E1"));
+    oss.clear();
+    oss.str("");
+    assert (x16.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x11.load(iss));
+    x11.recalculateAll(4);
+    for (int row = 1; row <= 4001; row += 250) {
+        std::string rowStr = std::to_string(row);
+        for (const char *col: {"A", "B", "C", "D", "E", "F"})
+            assert (valueMatch(x11.getValue(CPos(col + rowStr)), x16.getValue(CPos(col + rowStr))));
+    }
+    assert (valueMatch(x11.getValue(CPos("D4000")), x16.getValue(CPos("D4000"))));
+    assert (x16.getValue(CPos("D4000")).index() == 1);
+    assert (valueMatch(x11.getValue(CPos("F4000")), CValue(4.0)));
+    assert (valueMatch(x11.getValue(CPos("E1")), CValue()));
+
+    std::vector<CPos> positions;
+    std::vector<CValue> expected;
+    for (int row = 1; row <= 4000; row++)
+        for (const char *col: {"A", "B", "C", "D", "E", "F"}) {
+            positions.emplace_back(col + std::to_string(row));
+            expected.push_back(x16.getValue(positions.back()));
+        }
+    ofs.open(path, std::ios::binary);
+    assert (x16.save(ofs));
+    ofs.close();
+    CSpreadsheet x17;
+    iss.clear();
+    iss.str(oss.str());
+    assert (x17.load(iss));
+    CSpreadsheet x18;
+    assert (x18.loadMapped(path));
+    for (CSpreadsheet *sheet: {&x17, &x18}) {
+        std::atomic<size_t> mismatches = 0;
+        std::vector<std::thread> readers;
+        for (size_t thread = 0; thread < 8; thread++)
+            readers.emplace_back([sheet, thread, &positions, &expected, &mismatches]() {
+                // every reader walks the cells from another place, the later ones mostly read clean values
+                for (size_t i = 0; i < positions.size(); i++) {
+                    size_t index = (positions.size() - 1 - i + thread * 3001) % positions.size();
+                    if (!valueMatch(sheet->getValue(positions[index]), expected[index]))
+                        mismatches++;
+                }
+            });
+        for (std::thread &reader: readers)
+            reader.join();
+        assert (mismatches == 0);
+    }
+    // the copies share the mapped file, one of them is saved while the others are read
+    assert (x18.loadMapped(path));
+    CSpreadsheet x18copy(x18);
+    {
+        std::atomic<size_t> mismatches = 0;
+        std::ostringstream saved;
+        std::vector<std::thread> threads;
+        threads.emplace_back([&x18copy, &saved]() { assert (x18copy.save(saved)); });
+        for (size_t thread = 0; thread < 4; thread++)
+            threads.emplace_back([sheet = thread % 2 ? &x18 : &x18copy, thread, &positions, &expected, &mismatches]() {
+                for (size_t i = 0; i < positions.size(); i++) {
+                    size_t index = (i + thread * 5003) % positions.size();
+                    if (!valueMatch(sheet->getValue(positions[index]), expected[index]))
+                        mismatches++;
+                }
+            });
+        for (std::thread &thread: threads)
+            thread.join();
+        assert (mismatches == 0);
+        iss.clear();
+        iss.str(saved.str());
+        assert (x17.load(iss));
+        for (size_t i = 0; i < positions.size(); i += 97)
+            assert (valueMatch(x17.getValue(positions[i]), expected[i]));
+    }
+    std::remove(path);
+
+    std::vector<std::pair<CPos, std::string>> batch;
+    for (int row = 1; row <= 2000; row++) {
+        std::string rowStr = std::to_string(row);
+        batch.emplace_back(CPos("A" + rowStr), row == 1 ? "1" : "=A" + std::to_string(row - 1) + "+1");
+        batch.emplace_back(CPos("B" + rowStr), "=A" + rowStr + "*$C$1");
+    }
+    batch.emplace_back(CPos("C1"), "2");
+    batch.emplace_back(CPos("C2"), "=sum(B1:B2000)");
+    batch.emplace_back(CPos("C3"), "=1+");
+    batch.emplace_back(CPos("C1"), "3");
+    CSpreadsheet x19;
+    assert (x19.setCell(CPos("C3"), "old"));
+    assert (!x19.setCells(batch, 4));
+    assert (valueMatch(x19.getValue(CPos("A2000")), CValue(2000.0)));
+    assert (valueMatch(x19.getValue(CPos("B2000")), CValue(6000.0)));
+    assert (valueMatch(x19.getValue(CPos("C2")), CValue(6003000.0)));
+    assert (valueMatch(x19.getValue(CPos("C3")), CValue("old")));
+    batch.erase(batch.begin() + 3, batch.end());
+    batch[0].second = "=B2";
+    batch[1].second = "=A1";
+    batch[2].second = "text";
+    assert (x19.setCells(batch, 1));
+    assert (valueMatch(x19.getValue(CPos("A1")), CValue()));
+    assert (valueMatch(x19.getValue(CPos("C2")), CValue()));
+    assert (valueMatch(x19.getValue(CPos("A2")), CValue("text")));
+
+    CSpreadsheet x20;
+    assert (x20.setCell(CPos("A1"), "=-2^2"));
+    assert (x20.setCell(CPos("A2"), "=2^3^2"));
+    assert (x20.setCell(CPos("A3"), "=1=2<3"));
+    assert (x20.setCell(CPos("A4"), "= 2 * -3 + \"a\"\"b\" "));
+    assert (x20.setCell(CPos("A5"), "=countval (4, $a$1:A4) + sum((a1:a3))"));
+    assert (x20.setCell(CPos("A6"), "=1.e1 + 25E-1"));
+    assert (valueMatch(x20.getValue(CPos("A1")), CValue(-4.0)));
+    assert (valueMatch(x20.getValue(CPos("A2")), CValue(64.0)));
+    assert (valueMatch(x20.getValue(CPos("A3")), CValue(1.0)));
+    assert (valueMatch(x20.getValue(CPos("A4")), CValue("-6.000000a\"b")));
+    assert (valueMatch(x20.getValue(CPos("A5")), CValue(61.0)));
+    assert (valueMatch(x20.getValue(CPos("A6")), CValue(12.5)));
+    for (const char *invalid: {"=A1:B2", "=sum(A1)", "=if(A1:B2,1,2)", "=countval(A1:B2,A1:B2)", "=A1:B2+1", "=+1",
+                               "=2^-3", "=SUM(A1:B2)", "=avg(A1)", "=sum(A1:B2,)", "=A1 :B2", "=1<", "=.5", "=1e",
+                               "=\"a", "=(1", "=1)", "=$1", "=A$", "=", "=  "})
+        assert (!x20.setCell(CPos("B1"), invalid));
+    // the texts and the empty cells are skipped, an average of no numbers is empty
+    assert (x20.setCell(CPos("C1"), "=avg(A1:A6)"));
+    assert (x20.setCell(CPos("C2"), "=avg(D1:D9)"));
+    assert (x20.setCell(CPos("C3"), "=avg(A1:A8)*2+avg($A$1:A2)"));
+    assert (valueMatch(x20.getValue(CPos("C1")), CValue(134.5 / 5)));
+    assert (valueMatch(x20.getValue(CPos("C2")), CValue()));
+    assert (valueMatch(x20.getValue(CPos("C3")), CValue(134.5 / 5 * 2 + 30)));
+    oss.clear();
+    oss.str("");
+    assert (x20.save(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("C1")), CValue(134.5 / 5)));
+    assert (valueMatch(x11.getValue(CPos("C2")), CValue()));
+    assert (x11.setCell(CPos("D1"), "4"));
+    assert (valueMatch(x11.getValue(CPos("C2")), CValue(4.0)));
+    oss.clear();
+    oss.str("");
+    assert (x20.saveText(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("C3")), CValue(134.5 / 5 * 2 + 30)));
+
+    CSpreadsheet x21;
+    for (int row = 1; row <= 100; row++) {
+        std::string rowStr = std::to_string(row);
+        assert (x21.setCell(CPos("A" + rowStr), rowStr));
+        assert (x21.setCell(CPos("B" + rowStr), "=A1*1.5"));
+        assert (x21.setCell(CPos("C" + rowStr), "=A" + rowStr + "*2+$A$2"));
+        assert (x21.setCell(CPos("D" + rowStr), "=if(A" + rowStr + ">50,\"A" + rowStr + "\",\"\"\"\")"));
+    }
+    assert (x21.formulaCacheStats() == std::make_pair(size_t(198), size_t(102)));
+    assert (valueMatch(x21.getValue(CPos("B50")), CValue(1.5)));
+    assert (valueMatch(x21.getValue(CPos("C50")), CValue(102.0)));
+    assert (valueMatch(x21.getValue(CPos("D51")), CValue("A51")));
+    assert (!x21.setCell(CPos("E1"), "=A1*2+$A$2+"));
+    assert (x21.setCell(CPos("A1"), "=$A$2+C99"));
+    assert (valueMatch(x21.getValue(CPos("B100")), CValue(303.0)));
+    // a copy shares the cached formulas, the one inserting a formula gets its own tables
+    const std::pair<size_t, size_t> stats = x21.formulaCacheStats();
+    CSpreadsheet x21copy(x21);
+    assert (x21copy.setCell(CPos("C101"), "=A101*2+$A$2"));
+    assert (x21copy.setCell(CPos("F1"), "=1+A1*7"));
+    assert (x21copy.formulaCacheStats() == std::make_pair(stats.first + 1, stats.second + 1));
+    assert (x21.setCell(CPos("F2"), "=1+A2*7"));
+    assert (x21.formulaCacheStats() == std::make_pair(stats.first, stats.second + 1));
+    assert (x21copy.setCell(CPos("F2"), "=1+A2*7"));
+    assert (x21copy.formulaCacheStats() == std::make_pair(stats.first + 2, stats.second + 1));
+    oss.clear();
+    oss.str("");
+    assert (x21.saveText(oss));
+    iss.clear();
+    iss.str(oss.str());
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("C100")), CValue(202.0)));
+    assert (valueMatch(x11.getValue(CPos("B7")), CValue(303.0)));
+    assert (valueMatch(x11.getValue(CPos("D7")), CValue("\"")));
+    assert (valueMatch(x11.getValue(CPos("D70")), CValue("A70")));
+
+    CSpreadsheet x22;
+    const std::vector<std::pair<std::string, CValue>> literals = {
+            {"12", CValue(12.0)}, {" -1.5e1\t", CValue(-15.0)}, {"+.5", CValue(0.5)}, {"5.", CValue(5.0)},
+            {"12abc", CValue("12abc")}, {"0x10", CValue("0x10")}, {"inf", CValue("inf")}, {"nan", CValue("nan")},
+            {"1e999", CValue("1e999")}, {"--1", CValue("--1")}, {"+-1", CValue("+-1")}, {"1 2", CValue("1 2")},
+            {".", CValue(".")}, {"", CValue("")}};
+    for (const auto &[contents, value]: literals) {
+        assert (x22.setCell(CPos("A1"), contents));
+        assert (valueMatch(x22.getValue(CPos("A1")), value));
+    }
 
+    CSpreadsheet x23;
+    assert (x23.setCell(CPos("A1"), "2"));
+    assert (x23.setCell(CPos("B1"), "=(2+3)*A1"));
+    assert (x23.setCell(CPos("B2"), "=(0-5)^A1"));
+    assert (x23.setCell(CPos("B3"), "=A1*1+(A1-A1)*1"));
+    assert (x23.setCell(CPos("B4"), "=if(1>0,A1,1/0)"));
+    assert (x23.setCell(CPos("B5"), "=\"a\"+\"\"\"b\"+A1"));
+    assert (x23.setCell(CPos("B6"), "=1/0+A1"));
+    assert (x23.setCell(CPos("B7"), "=-(2-3)"));
+    oss.clear();
+    oss.str("");
+    assert (x23.saveText(oss));
+    for (const char *saved: {"=(5*A1)", "=((-5)^A1)", "=((A1*1)+(A1-A1))", "=A1", "=(\"a\"\"b\"+A1)",
+                             "=((1/0)+A1)", "=1"})
+        assert (oss.str().find(saved) != std::string::npos);
+    iss.clear();
+    iss.str(oss.str());
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("B1")), CValue(10.0)));
+    assert (valueMatch(x11.getValue(CPos("B2")), CValue(25.0)));
+    assert (valueMatch(x11.getValue(CPos("B3")), CValue(2.0)));
+    assert (valueMatch(x11.getValue(CPos("B4")), CValue(2.0)));
+    assert (valueMatch(x11.getValue(CPos("B5")), CValue("a\"b2.000000")));
+    assert (valueMatch(x11.getValue(CPos("B6")), CValue()));
+    assert (valueMatch(x11.getValue(CPos("B7")), CValue(1.0)));
+
+    // the chains are loaded dirty and evaluated from their far end, deeper than the native stack would allow
+    std::string chain = "1 50001 0~2 50001 0~";
+    for (int row = 1; row <= 50000; row++) {
+        std::string next = std::to_string(row + 1);
+        chain += "1 " + std::to_string(row) + " =A" + next + "+1~2 " + std::to_string(row) + " =sum(B" + next + ":C"
+                 + next + ")+1~";
+    }
+    iss.clear();
+    iss.str(chain);
+    assert (x11.load(iss));
+    assert (valueMatch(x11.getValue(CPos("A1")), CValue(50000.0)));
+    assert (valueMatch(x11.getValue(CPos("B1")), CValue(50000.0)));
+
+    CSpreadsheet x24;
+    assert (x24.setCell(CPos("A1"), "ab"));
+    assert (x24.setCell(CPos("A2"), "=A1+A1"));
+    assert (x24.setCell(CPos("A3"), "=if(A2>A1,A2+1.5,A1)+if(0,A1,A2)"));
+    assert (x24.setCell(CPos("A4"), "=countval(A1+\"ab\",A1:A3)+countval(A1,A1:A3)+(A3=A3)+(A1<>\"ab\")"));
+    assert (x24.setCell(CPos("A5"), "=(A2+A1<=A3)*10+-A1"));
+    assert (valueMatch(x24.getValue(CPos("A2")), CValue("abab")));
+    assert (valueMatch(x24.getValue(CPos("A3")), CValue("abab1.500000abab")));
+    assert (valueMatch(x24.getValue(CPos("A4")), CValue(3.0)));
+    assert (valueMatch(x24.getValue(CPos("A5")), CValue()));
+    assert (x24.setCell(CPos("A5"), "=(A2+A1<=A3)*10"));
+    assert (valueMatch(x24.getValue(CPos("A5")), CValue(0.0)));
+    assert (x24.setCell(CPos("B1"), "ab"));
+    assert (x24.setCell(CPos("B2"), "=(A1=B1)+(A1<>B1)*10+countval(B1,A1:B1)*100"));
+    assert (valueMatch(x24.getValue(CPos("B2")), CValue(201.0)));
+    assert (x24.setCell(CPos("A1"), "cd"));
+    assert (valueMatch(x24.getValue(CPos("B1")), CValue("ab")));
+    assert (valueMatch(x24.getValue(CPos("B2")), CValue(110.0)));
+    for (int i = 0; i < 3000; i++)
+        assert (x24.setCell(CPos("C1"), "text" + std::to_string(i)));
+    assert (valueMatch(x24.getValue(CPos("C1")), CValue("text2999")));
+    assert (valueMatch(x24.getValue(CPos("B1")), CValue("ab")));
+    assert (x24.textCount() == 3);
+    std::vector<std::pair<CPos, std::string>> texts;
+    for (size_t row = 1; row <= 2048; row++)
+        texts.emplace_back(CPos(4, row), row % 2 ? "ab" : "ef");
+    texts.emplace_back(CPos("E1"), "=(D1=B1)+(D2=D4)*10+countval(D1,D1:D2048)*100");
+    assert (x24.setCells(texts, 4));
+    assert (x24.textCount() == 4);
+    assert (valueMatch(x24.getValue(CPos("E1")), CValue(102411.0)));
+
+    // a reference shifted before the first row or column reads as empty, it does not wrap onto the last one
+    CSpreadsheet x25;
+    assert (x25.setCell(CPos("A0"), "5"));
+    assert (x25.setCell(CPos("A4294967294"), "7"));
+    assert (x25.setCell(CPos("MWLQKWT3"), "9"));
+    assert (x25.setCell(CPos("B2"), "=A0"));
+    assert (x25.setCell(CPos("C2"), "=sum(A0:A2)+1"));
+    assert (x25.setCell(CPos("D1"), "=A1"));
+    x25.copyRect(CPos("B0"), CPos("B2"), 2, 1);
+    x25.copyRect(CPos("A3"), CPos("D1"));
+    // a rectangle crossing the last row or column is clipped, one too far from its source is not copied
+    for (const char *pos: {"B4294967290", "B4294967291", "B4294967292"})
+        assert (x25.setCell(CPos(pos), pos));
+    x25.copyRect(CPos("B4294967293"), CPos("B4294967290"), 1, 3);
+    x25.copyRect(CPos("MWLQKWT5"), CPos("MWLQKWT3"), 5, 2);
+    x25.copyRect(CPos("B4294967294"), CPos("B0"), 2, 1);
+    x25.copyRect(CPos("D4"), CPos("B0"), -1, 2);
+    assert (valueMatch(x25.getValue(CPos("B0")), CValue()));
+    assert (valueMatch(x25.getValue(CPos("C0")), CValue()));
+    assert (valueMatch(x25.getValue(CPos("C2")), CValue(6.0)));
+    assert (valueMatch(x25.getValue(CPos("A3")), CValue()));
+    assert (valueMatch(x25.getValue(CPos("B4294967293")), CValue("B4294967290")));
+    assert (valueMatch(x25.getValue(CPos("B4294967294")), CValue("B4294967291")));
+    assert (valueMatch(x25.getValue(CPos("MWLQKWT5")), CValue(9.0)));
+    assert (valueMatch(x25.getValue(CPos("C4294967294")), CValue()));
+    assert (valueMatch(x25.getValue(CPos("D4")), CValue()));
+    bool outside = false;
+    try {
+        CPos("MWLQKWU1");
+    } catch (std::invalid_argument &) {
+        outside = true;
+    }
+    assert (outside);
+    assert (x25.setCell(CPos("A4294967294"), "8"));
+    assert (valueMatch(x25.getValue(CPos("B0")), CValue()));
 
     return EXIT_SUCCESS;
 }
 
-#endif /* __PROGTEST__ */
+#endif /* __PROGTEST__, SPREADSHEET_NO_MAIN */
@@ -0,0 +1,283 @@
+/** Benchmark of the public operations of CSpreadsheet on synthetic workloads. Every operation is run several times on
+ * a freshly prepared spreadsheet and the minimal and the median time are reported, the workloads are generated
+ * deterministically, so the runs are comparable.
+ *
+ * Usage: semester_benchmark [--reps N] [--scale X] [workload...]
+ */
+#include "spreadsheet.h"
+
+#include <chrono>
+#include <random>
+#include <thread>
+
+/** Struct representing a generated spreadsheet together with the operations measured on it */
+struct CWorkload {
+    std::string m_name;
+    std::vector<std::pair<CPos, std::string>> m_cells;
+    /** Cell set by the recalculation, its change reaches a large part of the spreadsheet */
+    CPos m_root;
+    std::string m_rootContents;
+    /** Rectangle copied by copyRect */
+    CPos m_copyDst;
+    CPos m_copySrc;
+    int m_copyW;
+    int m_copyH;
+};
+
+/** Struct representing the timings of one operation */
+struct CResult {
+    double m_min;
+    double m_median;
+};
+
+/** Function for getting the name of a position
+ * @param[in] col - column, 1 is A
+ * @param[in] row - row
+ * @return name of the position
+*/
+std::string posName(size_t col, size_t row) {
+    std::string out;
+    CPos(col, row).toStr(out);
+
+    return out;
+}
+
+/** Function for generating a wide sheet of numbers with the totals of every row and every column
+ * @param[in] scale - multiplier of the size
+ * @return the workload
+*/
+CWorkload wideSheet(double scale) {
+    const size_t w = 500, h = std::max<size_t>(1, size_t(200 * scale));
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (size_t row = 1; row <= h; row++) {
+        for (size_t col = 1; col <= w; col++) {
+            cells.emplace_back(CPos(col, row), std::to_string((col * 31 + row * 17) % 1000));
+        }
+        cells.emplace_back(CPos(w + 1, row), "=sum(" + posName(1, row) + ":" + posName(w, row) + ")");
+    }
+    for (size_t col = 1; col <= w + 1; col++) {
+        cells.emplace_back(CPos(col, h + 1), "=sum(" + posName(col, 1) + ":" + posName(col, h) + ")");
+    }
+
+    return {"wide", std::move(cells), CPos(1, 1), "7", CPos(w + 2, 1), CPos(w + 1, 1), 1, int(h)};
+}
+
+/** Function for generating a chain of cells, each adding one to the cell above
+ * @param[in] scale - multiplier of the size
+ * @return the workload
+*/
+CWorkload deepChain(double scale) {
+    const size_t h = std::max<size_t>(2, size_t(100000 * scale));
+    std::vector<std::pair<CPos, std::string>> cells;
+    cells.emplace_back(CPos(1, 1), "1");
+    for (size_t row = 2; row <= h; row++) {
+        cells.emplace_back(CPos(1, row), "=" + posName(1, row - 1) + "+1");
+    }
+
+    return {"chain", std::move(cells), CPos(1, 1), "2", CPos(2, 1), CPos(1, 1), 1, int(h)};
+}
+
+/** Function for generating columns of formulas filled down, every row refers to its own cells and to a parameter
+ * @param[in] scale - multiplier of the size
+ * @return the workload
+*/
+CWorkload fillDown(double scale) {
+    const size_t h = std::max<size_t>(1, size_t(50000 * scale));
+    std::vector<std::pair<CPos, std::string>> cells;
+    cells.emplace_back(CPos(5, 1), "2");
+    for (size_t row = 1; row <= h; row++) {
+        std::string a = posName(1, row), b = posName(2, row), c = posName(3, row);
+        cells.emplace_back(CPos(1, row), std::to_string(row));
+        cells.emplace_back(CPos(2, row), "=" + a + "*$E$1+1");
+        cells.emplace_back(CPos(3, row), "=if(" + b + ">" + a + "," + b + "-" + a + ",0)");
+        cells.emplace_back(CPos(4, row), "=sum(" + a + ":" + c + ")");
+    }
+
+    return {"filldown", std::move(cells), CPos(5, 1), "3", CPos(6, 1), CPos(2, 1), 3, int(h)};
+}
+
+/** Function for generating a sheet of texts drawn from a small vocabulary and of formulas comparing and joining them
+ * @param[in] scale - multiplier of the size
+ * @return the workload
+*/
+CWorkload textHeavy(double scale) {
+    static const char *const words[] = {"Czech Republic", "Slovakia", "Germany", "Austria", "Poland", "Hungary",
+                                        "OK", "FAILED", "PENDING", "United Kingdom of Great Britain"};
+    const size_t h = std::max<size_t>(1, size_t(100000 * scale));
+    std::mt19937 rng(1);
+    std::vector<std::pair<CPos, std::string>> cells;
+    cells.emplace_back(CPos(3, 1), "Germany");
+    for (size_t row = 1; row <= h; row++) {
+        std::string a = posName(1, row);
+        cells.emplace_back(CPos(1, row), words[rng() % std::size(words)]);
+        cells.emplace_back(CPos(2, row), "=if(" + a + "=$C$1,\"match\"," + a + "+\" \"+$C$1)");
+    }
+
+    return {"text", std::move(cells), CPos(3, 1), "Poland", CPos(4, 1), CPos(2, 1), 1, int(h)};
+}
+
+/** Function for generating clusters of three cells referencing each other in a cycle, with cells depending on them
+ * @param[in] scale - multiplier of the size
+ * @return the workload
+*/
+CWorkload cyclicClusters(double scale) {
+    const size_t clusters = std::max<size_t>(1, size_t(10000 * scale));
+    std::vector<std::pair<CPos, std::string>> cells;
+    for (size_t i = 0; i < clusters; i++) {
+        size_t row = 3 * i + 1;
+        cells.emplace_back(CPos(1, row), "=" + posName(1, row + 1) + "+1");
+        cells.emplace_back(CPos(1, row + 1), "=" + posName(1, row + 2) + "+1");
+        cells.emplace_back(CPos(1, row + 2), "=" + posName(1, row) + "+" + posName(2, row + 2));
+        for (size_t r = row; r < row + 3; r++) {
+            cells.emplace_back(CPos(2, r), std::to_string(r));
+            cells.emplace_back(CPos(3, r), "=" + posName(1, r) + "+" + posName(2, r));
+        }
+    }
+
+    return {"cyclic", std::move(cells), CPos(1, 3), "=B3", CPos(5, 1), CPos(1, 1), 3, int(3 * clusters)};
+}
+
+/** Function for running an operation repeatedly
+ * @param[in] reps - number of the runs
+ * @param[in] prepare - function preparing the state of a run, it is not timed
+ * @param[in] run - timed function
+ * @return timings in milliseconds
+*/
+template<typename TPrepare, typename TRun>
+CResult measure(size_t reps, const TPrepare &prepare, const TRun &run) {
+    std::vector<double> times;
+    for (size_t i = 0; i < reps; i++) {
+        prepare();
+        auto start = std::chrono::steady_clock::now();
+        run();
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+
+    return {times.front(), times[times.size() / 2]};
+}
+
+/** Function for printing the timings of an operation
+ * @param[in] workload - name of the workload
+ * @param[in] operation - name of the operation
+ * @param[in] items - number of the cells the operation handles
+ * @param[in] result - timings of the operation
+*/
+void report(const std::string &workload, const char *operation, size_t items, const CResult &result) {
+    printf("%-10s %-16s %10zu %10.2f %10.2f %14.0f\n", workload.c_str(), operation, items, result.m_min,
+           result.m_median, result.m_min > 0 ? double(items) / result.m_min * 1000 : 0);
+}
+
+/** Function for measuring all operations on a workload
+ * @param[in] workload - the workload
+ * @param[in] reps - number of the runs of every operation
+*/
+void runWorkload(const CWorkload &workload, size_t reps) {
+    const size_t n = workload.m_cells.size();
+    std::unique_ptr<CSpreadsheet> sheet;
+    auto fresh = [&sheet] { sheet = std::make_unique<CSpreadsheet>(); };
+
+    report(workload.m_name, "setCell", n, measure(reps, fresh, [&] {
+        for (const auto &[pos, contents]: workload.m_cells) {
+            sheet->setCell(pos, contents);
+        }
+    }));
+    report(workload.m_name, "setCells", n, measure(reps, fresh, [&] { sheet->setCells(workload.m_cells); }));
+
+    CSpreadsheet base;
+    base.setCells(workload.m_cells);
+    std::ostringstream binary, text;
+    base.save(binary);
+    base.saveText(text);
+    const std::string binaryData = binary.str(), textData = text.str();
+
+    std::ostringstream out;
+    report(workload.m_name, "save", n, measure(reps, [&out] { out.str(""); }, [&] { base.save(out); }));
+    report(workload.m_name, "saveText", n, measure(reps, [&out] { out.str(""); }, [&] { base.saveText(out); }));
+
+    std::istringstream in;
+    report(workload.m_name, "load", n, measure(reps, [&] {
+        fresh();
+        in.clear();
+        in.str(binaryData);
+    }, [&] { sheet->load(in); }));
+    report(workload.m_name, "loadText", n, measure(reps, [&] {
+        fresh();
+        in.clear();
+        in.str(textData);
+    }, [&] { sheet->load(in); }));
+
+    // a loaded spreadsheet is evaluated on the first read, the second read only returns the cached values
+    auto loaded = [&] {
+        fresh();
+        in.clear();
+        in.str(binaryData);
+        sheet->load(in);
+    };
+    auto readAll = [&] {
+        for (const auto &cell: workload.m_cells) {
+            sheet->getValue(cell.first);
+        }
+    };
+    report(workload.m_name, "getValue cold", n, measure(reps, loaded, readAll));
+    report(workload.m_name, "getValue warm", n, measure(reps, [] {}, readAll));
+    for (size_t threads: {1, 2, 4, 8}) {
+        // every thread reads all cells from another place, the throughput is the number of the reads per second
+        std::string name = "getValue " + std::to_string(threads) + "T";
+        report(workload.m_name, name.c_str(), n * threads, measure(reps, [] {}, [&] {
+            std::vector<std::thread> readers;
+            for (size_t thread = 0; thread < threads; thread++) {
+                readers.emplace_back([&, thread] {
+                    for (size_t i = 0; i < n; i++) {
+                        sheet->getValue(workload.m_cells[(i + thread * n / threads) % n].first);
+                    }
+                });
+            }
+            for (std::thread &reader: readers) {
+                reader.join();
+            }
+        }));
+    }
+    report(workload.m_name, "recalculateAll", n, measure(reps, loaded, [&] { sheet->recalculateAll(); }));
+
+    auto copy = [&] { sheet = std::make_unique<CSpreadsheet>(base); };
+    report(workload.m_name, "setCell root", 1, measure(reps, copy, [&] {
+        sheet->setCell(workload.m_root, workload.m_rootContents);
+    }));
+    report(workload.m_name, "copyRect", size_t(workload.m_copyW) * size_t(workload.m_copyH), measure(reps, copy, [&] {
+        sheet->copyRect(workload.m_copyDst, workload.m_copySrc, workload.m_copyW, workload.m_copyH);
+    }));
+}
+
+int main(int argc, char **argv) {
+    size_t reps = 5;
+    double scale = 1;
+    std::set<std::string> selected;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--reps" && i + 1 < argc) {
+            reps = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--scale" && i + 1 < argc) {
+            scale = atof(argv[++i]);
+        } else {
+            selected.insert(arg);
+        }
+    }
+
+    const std::vector<std::pair<const char *, CWorkload (*)(double)>> generators = {
+            {"wide",     wideSheet},
+            {"chain",    deepChain},
+            {"filldown", fillDown},
+            {"text",     textHeavy},
+            {"cyclic",   cyclicClusters}
+    };
+
+    printf("%-10s %-16s %10s %10s %10s %14s\n", "workload", "operation", "cells", "min ms", "median ms", "cells/s");
+    for (const auto &[name, generate]: generators) {
+        if (selected.empty() || selected.count(name)) {
+            runWorkload(generate(scale), reps);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,11 @@
+#ifndef spreadsheet_h_51e1d0c6a7b34f0e
+#define spreadsheet_h_51e1d0c6a7b34f0e
+
+/* The spreadsheet engine without the tests of all_in_one.cpp, which stays a single self-contained file. The header
+ * can be included by any number of translation units of a program, as every function of the engine defined out of its
+ * class is inline, a function added to all_in_one.cpp has to be inline as well. */
+#define SPREADSHEET_NO_MAIN
+
+#include "all_in_one.cpp"
+
+#endif /* spreadsheet_h_51e1d0c6a7b34f0e */